@@ -35,12 +35,26 @@ POSSIBILITY OF SUCH DAMAGE.
 #  error Only windows is supported
 #endif
 
+#include <climits>
+#include <cmath>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
+#include <cwctype>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define NO_GDI
 #define WIN32_LEAN_AND_MEAN
@@ -51,190 +65,4863 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <audiopolicy.h>
 #include <endpointvolume.h>
 #include <Functiondiscoverykeys_devpkey.h>
+#include <sddl.h>
 
+#if defined(_M_X64) || defined(_M_IX86)
+#  include <intrin.h>
+#  define HAVE_X86_KERNELS
+#endif
+
+
+/* =============================================================================
+ *  Types
+ */
+
+enum class Action {
+   Mute,
+   Unmute,
+   Status,
+   Toggle,
+   ToggleGroup,
+   Restore
+};
+
+/* A process given with -app, either by ID or by executable name */
+struct AppTarget {
+   DWORD pid;
+   std::wstring exe;
+};
+
+/* A range of channels given with -channels and the gain they get when
+ * muting, zero for silence */
+struct ChannelRule {
+   UINT first;
+   UINT last;
+   float gain;
+};
+
+struct Options {
+   bool silent = false;
+   Action action = Action::Mute;
+   unsigned jobs = 1;
+   bool daemon = false;
+   bool remote = false;
+   bool timings = false;
+   bool timingsJson = false;
+   std::string tracePath;
+   unsigned flushThreshold = 0;
+   bool json = false;
+   EDataFlow flow = eRender;
+   bool defaultFirst = false;
+   bool pipeline = false;
+   std::vector<std::wstring> ids;
+   std::vector<AppTarget> apps;
+   bool save = false;
+   std::string statePath;
+   unsigned fadeMs = 0;
+   std::vector<ChannelRule> channels;
+   bool enforce = false;
+   bool autoMute = false;
+   DWORD stateMask = DEVICE_STATE_ACTIVE;
+   bool singleFlight = false;
+   ULONGLONG requestKey = 0;
+   std::string cachePath;
+   bool trustCache = false;
+   std::string nameCachePath;
+   unsigned timeoutMs = 0;
+   unsigned endpointTimeoutMs = 0;
+};
+
+/* Collects the output for one stream in a preallocated buffer and writes it
+ * with a single call at exit, or whenever the threshold is reached. Lines are
+ * appended under a lock, so a line and its prefix always stay together, also
+ * with several threads printing at once. */
+class OutputWriter {
+public:
+   static const size_t capacity = 16 * 1024;
+
+   explicit OutputWriter(FILE* stream);
+
+   void SetThreshold(size_t threshold) { threshold_ = threshold; }
+   void Line(const wchar_t* prefix, const wchar_t* fmt, va_list ap);
+   void Text(const std::wstring& text);
+   void Flush();
+
+   /* Lets fill append to the buffer directly, for output that is built
+    * piecewise and must not go through a temporary string */
+   template <typename Fill>
+   void Append(Fill fill)
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (capacity - std::min(buffer_.size(), capacity) < capacity / 4) {
+         FlushLocked();
+      }
+      fill(buffer_);
+      if (buffer_.size() >= threshold_) {
+         FlushLocked();
+      }
+   }
+
+private:
+   void FlushLocked();
+
+   FILE* const stream_;
+   std::mutex lock_;
+   std::wstring buffer_;
+   size_t threshold_ = capacity;
+};
+
+enum class Phase {
+   ComInit,
+   CreateEnumerator,
+   Enumerate,
+   PropertyStore,
+   Activate,
+   GetMute,
+   SetMute,
+   Sessions,
+   Volume,
+   Count
+};
+
+struct PhaseTimes {
+   LONGLONG ticks[static_cast<int>(Phase::Count)] = { 0 };
+   ULONG calls[static_cast<int>(Phase::Count)] = { 0 };
+};
+
+_COM_SMARTPTR_TYPEDEF(IPropertyStore, __uuidof(IPropertyStore));
+_COM_SMARTPTR_TYPEDEF(IMMDevice, __uuidof(IMMDevice));
+_COM_SMARTPTR_TYPEDEF(IMMDeviceCollection, __uuidof(IMMDeviceCollection));
+_COM_SMARTPTR_TYPEDEF(IAudioSessionManager2, __uuidof(IAudioSessionManager2));
+_COM_SMARTPTR_TYPEDEF(IAudioEndpointVolume, __uuidof(IAudioEndpointVolume));
+_COM_SMARTPTR_TYPEDEF(IMMDeviceEnumerator, __uuidof(IMMDeviceEnumerator));
+_COM_SMARTPTR_TYPEDEF(IAudioSessionControl, __uuidof(IAudioSessionControl));
+_COM_SMARTPTR_TYPEDEF(IMMEndpoint, __uuidof(IMMEndpoint));
+_COM_SMARTPTR_TYPEDEF(
+   IAudioSessionEnumerator, __uuidof(IAudioSessionEnumerator));
+_COM_SMARTPTR_TYPEDEF(IAudioSessionControl2, __uuidof(IAudioSessionControl2));
+_COM_SMARTPTR_TYPEDEF(ISimpleAudioVolume, __uuidof(ISimpleAudioVolume));
+
+enum class EndpointStatus {
+   Pending,
+   TimedOut,
+   ItemFailed,
+   NotFound,
+   PropertyStoreFailed,
+   NameFailed,
+   EndpointVolumeFailed,
+   SessionsFailed,
+   ChannelsFailed,
+   GetMuteFailed,
+   SetMuteFailed,
+   SetVolumeFailed,
+   Unchanged,
+   Changed,
+   Skipped,
+   Filtered,
+   NoSessions,
+   NotSaved,
+   Fading
+};
+
+/* The state file written by -save is a StateHeader followed by the entries,
+ * sorted by the hash of the endpoint ID, so it can be used mapped as is. */
+struct StateHeader {
+   DWORD magic;
+   DWORD version;
+   DWORD count;
+   DWORD reserved;
+};
+
+struct StateEntry {
+   ULONGLONG idHash;
+   DWORD muted;
+   float volume;   /* negative if unknown */
+};
+
+/* The -cache file is a CacheHeader, the entries sorted by the hash of the
+ * endpoint ID and then the names they point into, without terminators. */
+struct CacheHeader {
+   DWORD magic;
+   DWORD version;
+   ULONGLONG fingerprint;
+   DWORD count;
+   DWORD nameChars;
+};
+
+struct CacheEntry {
+   ULONGLONG idHash;
+   DWORD muted;
+   DWORD nameOffset;
+   DWORD nameLength;
+   DWORD nameUs;    /* what reading the name took the last time */
+   DWORD probeUs;   /* the same for activating and reading the state */
+   DWORD flow;
+};
+
+/* The -name-cache file is a NameCacheHeader, the entries sorted by the hash
+ * of the endpoint ID and then the names, each distinct one stored once. */
+struct NameCacheHeader {
+   DWORD magic;
+   DWORD version;
+   DWORD count;
+   DWORD nameChars;
+};
+
+struct NameEntry {
+   ULONGLONG idHash;
+   DWORD nameOffset;
+   DWORD nameLength;
+};
+
+struct DeviceCache {
+   ULONGLONG fingerprint = 0;
+   std::vector<CacheEntry> entries;
+   std::wstring names;
+   bool matched = false;
+};
+
+/* A device whose interfaces are activated on first use only, so every
+ * operation pays just for what it actually needs. */
+class EndpointHandle {
+public:
+   IMMDevicePtr Device() const { return device_; }
+   void Reset(IMMDevicePtr device);
+   void Invalidate() { volume_ = nullptr; }
+
+   HRESULT PropertyStore(IPropertyStorePtr& propStore);
+   HRESULT Volume(IAudioEndpointVolumePtr& endpointVolume);
+   HRESULT SessionManager(IAudioSessionManager2Ptr& sessionManager);
+
+   /* Number of interfaces that were never needed */
+   ULONG Unused() const;
+
+private:
+   IMMDevicePtr device_;
+   IPropertyStorePtr propStore_;
+   IAudioEndpointVolumePtr volume_;
+   IAudioSessionManager2Ptr sessionManager_;
+};
+
+struct ActivationStats {
+   std::atomic<ULONG> activated = 0;
+   std::atomic<ULONG> avoided = 0;
+};
+
+struct Endpoint {
+   UINT index = 0;
+   std::wstring id;
+   EDataFlow flow = eRender;
+   DWORD state = DEVICE_STATE_ACTIVE;
+   EndpointHandle handle;
+   std::wstring name;
+   EndpointStatus status = EndpointStatus::Pending;
+   HRESULT hr = S_OK;
+   BOOL wasMuted = FALSE;
+   BOOL muted = FALSE;
+   float volume = -1.0f;
+   const StateEntry* saved = nullptr;
+   const CacheEntry* cached = nullptr;
+   bool trusted = false;
+   UINT sessions = 0;
+   UINT sessionsMuted = 0;
+   UINT sessionsChanged = 0;
+   UINT channelsChanged = 0;
+   const wchar_t* formFactor = nullptr;
+   Phase hungIn = Phase::Count;
+   bool queued = false;   /* timed out before it was started */
+   PhaseTimes times;
+   LONGLONG ticks = 0;
+   bool done = false;
+};
+
+enum class FilterField {
+   Name,
+   Id,
+   Flow,
+   FormFactor,
+   Count
+};
+
+enum class FilterResult {
+   Excluded,
+   Included,
+   Undecided
+};
+
+/* A case-insensitive glob with '*' and '?'. The pattern is folded once when
+ * it is compiled, matching never allocates. */
+class GlobPattern {
+public:
+   explicit GlobPattern(const std::wstring& pattern);
+   bool Match(const wchar_t* text) const;
+   const std::wstring& Pattern() const { return pattern_; }
+
+private:
+   std::wstring pattern_;
+};
+
+struct FilterRule {
+   FilterField field;
+   bool exclude;
+   GlobPattern pattern;
+};
+
+/* The -include and -exclude rules. An endpoint is selected if it matches any
+ * include rule, or there are none, and no exclude rule. */
+class DeviceFilter {
+public:
+   bool Add(const std::wstring& rule, bool exclude);
+   bool Empty() const { return rules_.empty(); }
+   bool Needs(FilterField field) const;
+
+   /* The same for all filters that select the same endpoints */
+   std::wstring Key() const;
+
+   /* Decides on the fields known so far, the others are null. Undecided
+    * means only the unknown fields can settle it. */
+   FilterResult Evaluate(const wchar_t* const* values) const;
+
+private:
+   std::vector<FilterRule> rules_;
+};
+
+struct AudioSession {
+   DWORD pid;
+   ISimpleAudioVolumePtr volume;
+};
+
+/* The sessions of one endpoint, loaded in a single pass and indexed by
+ * process ID and executable name. */
+class SessionTable {
+public:
+   HRESULT Load(IAudioSessionManager2Ptr sessionManager);
+
+   /* The sessions of all -app targets, each one only once */
+   std::vector<ISimpleAudioVolumePtr> Match(
+      const std::vector<AppTarget>& targets) const;
+
+private:
+   std::vector<AudioSession> sessions_;
+   std::unordered_multimap<DWORD, size_t> byPid_;
+   std::unordered_multimap<std::wstring, size_t> byName_;
+};
+
+/* Friendly names by endpoint ID, looked up in the mapped -name-cache file.
+ * Names read during the run and renames reported by notifications are kept
+ * on the side until Save() writes everything back. */
+class NameCache {
+public:
+   void Open(const std::string& path);
+   void Close();
+   bool Find(const std::wstring& id, std::wstring& name);
+   void Add(const std::wstring& id, const std::wstring& name);
+   void Invalidate(const std::wstring& id);
+   void Save();
+
+private:
+   void Map();
+   void Unmap();
+
+   std::mutex lock_;
+   std::string path_;
+   HANDLE mapping_ = nullptr;
+   const void* view_ = nullptr;
+   std::span<const NameEntry> entries_;
+   const wchar_t* names_ = nullptr;
+   DWORD nameChars_ = 0;
+   /* An empty name drops the mapped entry */
+   std::unordered_map<ULONGLONG, std::wstring> changes_;
+};
+
+/* A volume ramp run by the fade scheduler. A fade out ends muted at the
+ * original level, a fade in starts muted at zero. A fade of -channels moves
+ * each of them from its current level to its target instead. */
+struct Fade {
+   Endpoint* ep;
+   IAudioEndpointVolumePtr volume;
+   float level;
+   bool mute;
+   std::vector<UINT> channels;
+   std::vector<float> from;
+   std::vector<float> to;
+};
+
+/* The per-channel level math, in the best variant the CPU supports. Both
+ * clamp their results to [0, 1]. */
+struct LevelKernels {
+   const wchar_t* name;
+   /* out = levels * gains */
+   void (*scale)(const float* levels, const float* gains, float* out,
+                 size_t count);
+   /* out = to + (from - to) * t */
+   void (*lerp)(const float* to, const float* from, float t, float* out,
+                size_t count);
+};
+
+struct FadeStats {
+   ULONG ticks;
+   LONGLONG jitter;
+   LONGLONG maxJitter;
+};
+
+struct EnforceStats {
+   ULONG reactions;
+   LONGLONG latency;
+   LONGLONG maxLatency;
+};
+
+struct EndpointTimes {
+   std::wstring name;
+   PhaseTimes times;
+   LONGLONG ticks;
+};
+
+struct PipelineStats {
+   size_t maxDepth;
+   LONGLONG inputStall;
+   LONGLONG outputStall;
+};
+
+struct TraceEvent {
+   LONGLONG start;
+   LONGLONG end;
+   UINT endpoint;
+   Phase phase;
+};
+
+/* Trace events of a single thread. The buffer is allocated up front and
+ * wraps around, so recording never allocates or takes a lock. */
+struct TraceRing {
+   static const size_t capacity = 4096;
+
+   DWORD threadId = 0;
+   size_t count = 0;
+   TraceEvent events[capacity];
+};
+
+struct DeviceInfo {
+   std::wstring id;
+   DWORD state;
+   EDataFlow flow;
+   bool isDefault;
+   bool renamed;        /* since the last snapshot */
+   bool stateChanged;   /* since the last snapshot */
+};
+
+/* A device that was added or became active, and when we were told */
+struct Arrival {
+   std::wstring id;
+   LONGLONG ticks;
+};
+
+/* Latencies in power of two buckets, the first one holds everything below
+ * its upper bound */
+struct LatencyHistogram {
+   static const int bucketCount = 16;
+   static const LONGLONG firstBoundUs = 64;
+
+   ULONG buckets[bucketCount];
+   ULONG count;
+   LONGLONG max;
+};
+
+/* The result of the last run, shared by all instances with -single-flight.
+ * Only accessed while holding the run mutex, except for the sequence. */
+struct FlightSlot {
+   volatile LONG sequence;
+   ULONGLONG key;   /* zero if the run cannot be reused */
+   DWORD success;
+   DWORD endpoints;
+   DWORD changed;
+};
+
+struct DaemonRequest {
+   DWORD version;
+   DWORD action;
+};
+
+struct DaemonResponse {
+   DWORD version;
+   DWORD success;
+   /* followed by the UTF-16 report text */
+};
+
+/* =============================================================================
+ *  Globals
+ */
+
+static const char* programName_ = nullptr;
+static struct Options opts_;
+static HANDLE stopEvent_ = nullptr;
+static thread_local std::wstring* capture_ = nullptr;
+static OutputWriter output_(stdout);
+static OutputWriter errorOutput_(stderr);
+static ActivationStats activationStats_;
+static PhaseTimes runTimes_;
+static std::vector<EndpointTimes> endpointTimes_;
+static LONGLONG startTicks_ = 0;
+static std::atomic<LONGLONG> firstSilenceTicks_ = 0;
+static std::wstring defaultEndpointId_;
+static bool measure_ = false;
+static DeviceFilter filter_;
+static std::mutex processNamesLock_;
+static std::unordered_map<DWORD, std::wstring> processNames_;
+static std::span<const StateEntry> savedState_;
+static NameCache nameCache_;
+static bool groupMuted_ = false;
+static std::mutex fadeLock_;
+static std::vector<Fade> fades_;
+static std::vector<float> fadeCurve_;
+static FadeStats fadeStats_ = { 0 };
+static LevelKernels levelKernels_ = { 0 };
+static EnforceStats enforceStats_ = { 0 };
+static LatencyHistogram arrivalLatency_ = { 0 };
+static std::chrono::steady_clock::time_point deadline_;
+static HANDLE runDone_ = nullptr;
+static std::mutex timeoutLock_;
+/* The call the endpoint of this thread is in, while it can be abandoned */
+static thread_local std::atomic<Phase>* currentCall_ = nullptr;
+static thread_local TraceRing* traceRing_ = nullptr;
+static std::mutex traceLock_;
+static std::vector<std::unique_ptr<TraceRing>> traceRings_;
+static const LONGLONG ticksPerSecond_ = [] {
+   LARGE_INTEGER frequency;
+   QueryPerformanceFrequency(&frequency);
+   return frequency.QuadPart;
+}();
+
+static const wchar_t* const statusKeys_[] = {
+   L"pending", L"timed_out", L"item_failed", L"not_found",
+   L"property_store_failed", L"name_failed",
+   L"activate_failed", L"sessions_failed", L"channels_failed",
+   L"get_mute_failed",
+   L"set_mute_failed", L"set_volume_failed",
+   L"unchanged", L"changed", L"skipped", L"filtered", L"no_sessions",
+   L"not_saved", L"fading"
+};
+
+static const wchar_t* const flowKeys_[] = { L"render", L"capture" };
+
+/* The device states -include-inactive reports on */
+static const DWORD reportedStates_[] = {
+   DEVICE_STATE_ACTIVE, DEVICE_STATE_DISABLED, DEVICE_STATE_UNPLUGGED
+};
+static const wchar_t* const reportedStateKeys_[] = {
+   L"active", L"disabled", L"unplugged"
+};
+
+static const wchar_t* const filterFieldKeys_[] = {
+   L"name", L"id", L"flow", L"formfactor"
+};
+
+/* Indexed by EndpointFormFactor */
+static const wchar_t* const formFactorKeys_[] = {
+   L"remote", L"speakers", L"linelevel", L"headphones", L"microphone",
+   L"headset", L"handset", L"digital", L"spdif", L"hdmi", L"unknown"
+};
+
+/* PKEY_AudioEndpoint_FormFactor, which not every SDK exports */
+static const PROPERTYKEY formFactorKey_ = {
+   { 0x1da5d803, 0xd492, 0x4edd,
+     { 0x8c, 0x23, 0xe0, 0xc0, 0xff, 0xee, 0x7f, 0x0e } },
+   0
+};
+
+static const int pipelineStageCount_ = 4;
+static PipelineStats pipelineStats_[pipelineStageCount_] = { 0 };
+static const wchar_t* const pipelineStageNames_[] = {
+   L"resolve", L"name", L"activate", L"mute"
+};
+
+static const wchar_t* const phaseNames_[] = {
+   L"COM init", L"Create enumerator", L"Enumerate", L"Property store",
+   L"Activate", L"GetMute", L"SetMute", L"Sessions", L"Volume"
+};
+static const wchar_t* const phaseKeys_[] = {
+   L"com_init", L"create_enumerator", L"enumerate", L"property_store",
+   L"activate", L"get_mute", L"set_mute", L"sessions", L"volume"
+};
+
+static const unsigned fadeTickMs_ = 5;
+static const double fadeFloorDb_ = -60.0;
+
+/* Tags our own volume writes, so the notifications they cause can be told
+ * apart from changes made by others */
+static const GUID eventContext_ = {
+   0x6d2b1c4e, 0x8f3a, 0x4b7e,
+   { 0x9a, 0x15, 0x2c, 0x7d, 0x40, 0xe3, 0x5b, 0x91 }
+};
+
+static const DWORD stateMagic_ = 0x5354554d;   /* "MUTS" */
+static const DWORD stateVersion_ = 1;
+
+static const DWORD cacheMagic_ = 0x4354554d;   /* "MUTC" */
+static const DWORD cacheVersion_ = 2;
+
+static const DWORD nameCacheMagic_ = 0x4e54554d;   /* "MUTN" */
+static const DWORD nameCacheVersion_ = 1;
+
+/* Global names coordinate all sessions. Any authenticated user may wait on
+ * and release the mutex and read and write the slot, whoever created them. */
+static const wchar_t* const flightMutexName_ = L"Global\\lx-s.mute.flight";
+static const wchar_t* const flightSlotName_ =
+   L"Global\\lx-s.mute.flight.slot";
+static const wchar_t* const flightMutexSddl_ =
+   L"D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x00100001;;;AU)";   /* sync, modify */
+static const wchar_t* const flightSlotSddl_ =
+   L"D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x0006;;;AU)";   /* map read, write */
+
+static const wchar_t* const daemonPipeName_ = L"\\\\.\\pipe\\lx-s.mute";
+static const DWORD daemonProtocolVersion_ = 1;
+
+/* The index of an endpoint that was processed before it got its place in
+ * the list */
+static const UINT pendingIndex_ = UINT_MAX - 1;
+
+static const int exitTimedOut_ = 2;
+/* The watchdog waits this much longer than the endpoints do */
+static const DWORD watchdogGraceMs_ = 50;
+
+/* =============================================================================
+ *  Output
+ */
+
+static int FormattedLength(const wchar_t* fmt, va_list ap)
+{
+   va_list count;
+   va_copy(count, ap);
+   const int len = _vscwprintf(fmt, count);
+   va_end(count);
+   return len;
+}
+
+static void AppendLine(
+   std::wstring& buffer,
+   const wchar_t* prefix,
+   const wchar_t* fmt,
+   va_list ap,
+   int len)
+{
+   buffer.append(prefix);
+   const size_t offset = buffer.size();
+   buffer.resize(offset + len + 1);
+   _vsnwprintf_s(&buffer[offset], len + 1, _TRUNCATE, fmt, ap);
+   buffer[offset + len] = L'\n';
+}
+
+OutputWriter::OutputWriter(FILE* stream)
+   : stream_(stream)
+{
+   buffer_.reserve(capacity);
+}
+
+void OutputWriter::Line(const wchar_t* prefix, const wchar_t* fmt, va_list ap)
+{
+   const int len = FormattedLength(fmt, ap);
+   if (len < 0) {
+      return;
+   }
+   std::lock_guard<std::mutex> guard(lock_);
+   if (buffer_.size() + wcslen(prefix) + len + 1 > capacity) {
+      FlushLocked();
+   }
+   AppendLine(buffer_, prefix, fmt, ap, len);
+   if (buffer_.size() >= threshold_) {
+      FlushLocked();
+   }
+}
+
+void OutputWriter::Text(const std::wstring& text)
+{
+   std::lock_guard<std::mutex> guard(lock_);
+   if (buffer_.size() + text.size() > capacity) {
+      FlushLocked();
+   }
+   buffer_ += text;
+   if (buffer_.size() >= threshold_) {
+      FlushLocked();
+   }
+}
+
+void OutputWriter::Flush()
+{
+   std::lock_guard<std::mutex> guard(lock_);
+   FlushLocked();
+}
+
+void OutputWriter::FlushLocked()
+{
+   if (!buffer_.empty()) {
+      fputws(buffer_.c_str(), stream_);
+      fflush(stream_);
+      buffer_.clear();
+   }
+}
+
+static void FlushOutput()
+{
+   output_.Flush();
+   errorOutput_.Flush();
+}
+
+/* Appends a formatted line to the capture buffer of the current thread,
+ * which the daemon uses to send reports back to its clients. */
+static void CaptureLine(const wchar_t* prefix, const wchar_t* fmt, va_list ap)
+{
+   const int len = FormattedLength(fmt, ap);
+   if (len >= 0) {
+      AppendLine(*capture_, prefix, fmt, ap, len);
+   }
+}
+
+static void PrintError(const wchar_t* fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   if (capture_ != nullptr) {
+      CaptureLine(L"! ", fmt, ap);
+   } else if (!opts_.silent) {
+      errorOutput_.Line(L"! ", fmt, ap);
+   }
+   va_end(ap);
+}
+
+static void Print(const wchar_t* fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   if (capture_ != nullptr) {
+      CaptureLine(L"", fmt, ap);
+   } else if (!opts_.silent) {
+      output_.Line(L"", fmt, ap);
+   }
+   va_end(ap);
+}
+
+/* Appends str as a JSON string. Everything outside of printable ASCII is
+ * written as a unicode escape of its UTF-16 code unit, which keeps surrogate
+ * pairs intact and the output independent of the console code page. */
+static void AppendJsonString(std::wstring& out, const wchar_t* str)
+{
+   static const wchar_t hex[] = L"0123456789abcdef";
+
+   out += L'"';
+   for (const wchar_t* c = str; *c != L'\0'; ++c) {
+      if (*c == L'"' || *c == L'\\') {
+         out += L'\\';
+         out += *c;
+      } else if (*c < 0x20 || *c > 0x7e) {
+         const unsigned code = static_cast<unsigned>(*c);
+         out += L"\\u";
+         out += hex[(code >> 12) & 0xf];
+         out += hex[(code >> 8) & 0xf];
+         out += hex[(code >> 4) & 0xf];
+         out += hex[code & 0xf];
+      } else {
+         out += *c;
+      }
+   }
+   out += L'"';
+}
+
+static std::wstring JsonEscape(const std::wstring& str)
+{
+   std::wstring escaped;
+   escaped.reserve(str.size() + 2);
+   AppendJsonString(escaped, str.c_str());
+   return escaped.substr(1, escaped.size() - 2);
+}
+
+/* Writes a single-line JSON object straight into an output buffer */
+class JsonRecord {
+public:
+   explicit JsonRecord(std::wstring& out)
+      : out_(out)
+   {
+      out_ += L'{';
+   }
+
+   ~JsonRecord()
+   {
+      out_ += L"}\n";
+   }
+
+   JsonRecord(const JsonRecord&) = delete;
+   JsonRecord& operator=(const JsonRecord&) = delete;
+
+   void String(const wchar_t* key, const wchar_t* value)
+   {
+      Key(key);
+      AppendJsonString(out_, value);
+   }
+
+   void Number(const wchar_t* key, LONGLONG value)
+   {
+      wchar_t number[32];
+      swprintf(number, 32, L"%lld", value);
+      Literal(key, number);
+   }
+
+   void Literal(const wchar_t* key, const wchar_t* value)
+   {
+      Key(key);
+      out_ += value;
+   }
+
+private:
+   void Key(const wchar_t* key)
+   {
+      if (!first_) {
+         out_ += L',';
+      }
+      first_ = false;
+      AppendJsonString(out_, key);
+      out_ += L':';
+   }
+
+   std::wstring& out_;
+   bool first_ = true;
+};
+
+/* =============================================================================
+ *  Timings
+ */
+
+static LONGLONG Now()
+{
+   LARGE_INTEGER now;
+   QueryPerformanceCounter(&now);
+   return now.QuadPart;
+}
+
+static double TicksToMs(LONGLONG ticks)
+{
+   return static_cast<double>(ticks) * 1000.0 / ticksPerSecond_;
+}
+
+static LONGLONG TicksToUs(LONGLONG ticks)
+{
+   return ticks * 1000000 / ticksPerSecond_;
+}
+
+/* Remembers when the first endpoint of the run was silent */
+static void RecordSilence()
+{
+   if (firstSilenceTicks_ == 0) {
+      LONGLONG expected = 0;
+      firstSilenceTicks_.compare_exchange_strong(expected, Now() - startTicks_);
+   }
+}
+
+static void RecordLatency(LatencyHistogram& histogram, LONGLONG ticks)
+{
+   int bucket = 0;
+   for (LONGLONG bound = LatencyHistogram::firstBoundUs;
+        TicksToUs(ticks) >= bound
+        && bucket < LatencyHistogram::bucketCount - 1;
+        bound *= 2) {
+      ++bucket;
+   }
+   ++histogram.buckets[bucket];
+   ++histogram.count;
+   histogram.max = std::max(histogram.max, ticks);
+}
+
+/* Moves the events the calling thread recorded for endpoint from over to
+ * endpoint to, for an endpoint that was processed before its index was
+ * known */
+static void RelabelTrace(UINT from, UINT to)
+{
+   if (traceRing_ == nullptr) {
+      return;
+   }
+   TraceRing& ring = *traceRing_;
+   const size_t count = std::min(ring.count, TraceRing::capacity);
+   for (size_t i = ring.count - count; i < ring.count; ++i) {
+      TraceEvent& ev = ring.events[i % TraceRing::capacity];
+      if (ev.endpoint == from) {
+         ev.endpoint = to;
+      }
+   }
+}
+
+/* Sets up the trace buffer of the calling thread, so that the first
+ * recorded event does not pay for the allocation. */
+static void StartTraceThread()
+{
+   if (opts_.tracePath.empty() || traceRing_ != nullptr) {
+      return;
+   }
+   auto ring = std::make_unique<TraceRing>();
+   ring->threadId = GetCurrentThreadId();
+   traceRing_ = ring.get();
+   std::lock_guard<std::mutex> guard(traceLock_);
+   traceRings_.push_back(std::move(ring));
+}
+
+/* Measures one backend call, either for a single endpoint or for the whole
+ * run. Costs a single branch unless -timings or -trace was given. */
+class PhaseSpan {
+public:
+   explicit PhaseSpan(Phase phase, Endpoint* ep = nullptr)
+      : phase_(phase),
+        ep_(ep),
+        start_(measure_ ? Now() : 0),
+        outer_((currentCall_ != nullptr)
+           ? currentCall_->exchange(phase) : Phase::Count)
+   {
+   }
+
+   ~PhaseSpan()
+   {
+      if (start_ != 0) {
+         Record(Now());
+      }
+      if (currentCall_ != nullptr) {
+         currentCall_->store(outer_);
+      }
+   }
+
+   PhaseSpan(const PhaseSpan&) = delete;
+   PhaseSpan& operator=(const PhaseSpan&) = delete;
+
+private:
+   void Record(LONGLONG end)
+   {
+      PhaseTimes& times = (ep_ != nullptr) ? ep_->times : runTimes_;
+      times.ticks[static_cast<int>(phase_)] += end - start_;
+      ++times.calls[static_cast<int>(phase_)];
+
+      if (opts_.tracePath.empty()) {
+         return;
+      }
+      StartTraceThread();
+      TraceRing& ring = *traceRing_;
+      ring.events[ring.count++ % TraceRing::capacity] = {
+         start_, end, (ep_ != nullptr) ? ep_->index : UINT_MAX, phase_
+      };
+   }
+
+   const Phase phase_;
+   Endpoint* const ep_;
+   const LONGLONG start_;
+   const Phase outer_;
+};
+
+/* The time of a phase over the whole run and all endpoints */
+static void SumPhase(int phase, LONGLONG& ticks, ULONG& calls)
+{
+   ticks = runTimes_.ticks[phase];
+   calls = runTimes_.calls[phase];
+   for (const EndpointTimes& ep : endpointTimes_) {
+      ticks += ep.times.ticks[phase];
+      calls += ep.times.calls[phase];
+   }
+}
+
+static void PrintTimingsTable(LONGLONG totalTicks)
+{
+   const int phaseCount = static_cast<int>(Phase::Count);
+
+   Print(L"%-20ls %8ls %12ls", L"Phase", L"Calls", L"Total ms");
+   for (int phase = 0; phase < phaseCount; ++phase) {
+      LONGLONG ticks = 0;
+      ULONG calls = 0;
+      SumPhase(phase, ticks, calls);
+      Print(
+         L"%-20ls %8lu %12.3f",
+         phaseNames_[phase], calls, TicksToMs(ticks));
+   }
+   Print(L"%-20ls %8ls %12.3f", L"Total", L"", TicksToMs(totalTicks));
+   if (firstSilenceTicks_ != 0) {
+      Print(
+         L"%-20ls %8ls %12.3f",
+         L"First silence", L"", TicksToMs(firstSilenceTicks_));
+   }
+   Print(
+      L"Interface activations: %lu performed, %lu avoided",
+      activationStats_.activated.load(), activationStats_.avoided.load());
+   if (!opts_.channels.empty()) {
+      Print(L"Channel level kernel: %ls", levelKernels_.name);
+   }
+   if (fadeStats_.ticks != 0) {
+      Print(
+         L"Fade ticks: %lu, jitter %.3f ms average, %.3f ms max",
+         fadeStats_.ticks,
+         TicksToMs(fadeStats_.jitter) / fadeStats_.ticks,
+         TicksToMs(fadeStats_.maxJitter));
+   }
+   if (enforceStats_.reactions != 0) {
+      Print(
+         L"Enforced: %lu times, reaction %.3f ms average, %.3f ms max",
+         enforceStats_.reactions,
+         TicksToMs(enforceStats_.latency) / enforceStats_.reactions,
+         TicksToMs(enforceStats_.maxLatency));
+   }
+   if (arrivalLatency_.count != 0) {
+      Print(L"");
+      Print(
+         L"Arrival to mute: %lu endpoints, %.3f ms max",
+         arrivalLatency_.count, TicksToMs(arrivalLatency_.max));
+      LONGLONG bound = LatencyHistogram::firstBoundUs;
+      for (int i = 0; i < LatencyHistogram::bucketCount; ++i, bound *= 2) {
+         if (arrivalLatency_.buckets[i] == 0) {
+            continue;
+         }
+         if (i == LatencyHistogram::bucketCount - 1) {
+            Print(
+               L"  >= %8lld us %8lu", bound / 2, arrivalLatency_.buckets[i]);
+         } else {
+            Print(L"  <  %8lld us %8lu", bound, arrivalLatency_.buckets[i]);
+         }
+      }
+   }
+
+   if (opts_.pipeline) {
+      Print(L"");
+      Print(
+         L"%-20ls %8ls %12ls %12ls",
+         L"Pipeline stage", L"Depth", L"In wait ms", L"Out wait ms");
+      for (int stage = 0; stage < pipelineStageCount_; ++stage) {
+         const PipelineStats& stats = pipelineStats_[stage];
+         Print(
+            L"%-20ls %8zu %12.3f %12.3f",
+            pipelineStageNames_[stage], stats.maxDepth,
+            TicksToMs(stats.inputStall), TicksToMs(stats.outputStall));
+      }
+   }
+
+   if (endpointTimes_.empty()) {
+      return;
+   }
+   Print(L"");
+   Print(
+      L"%-32ls %10ls %10ls %10ls %10ls %10ls %10ls",
+      L"Endpoint (ms)", L"Total", L"Enumerate", L"Property",
+      L"Activate", L"GetMute", L"SetMute");
+   for (const EndpointTimes& ep : endpointTimes_) {
+      Print(
+         L"%-32.32ls %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f",
+         ep.name.c_str(), TicksToMs(ep.ticks),
+         TicksToMs(ep.times.ticks[static_cast<int>(Phase::Enumerate)]),
+         TicksToMs(ep.times.ticks[static_cast<int>(Phase::PropertyStore)]),
+         TicksToMs(ep.times.ticks[static_cast<int>(Phase::Activate)]),
+         TicksToMs(ep.times.ticks[static_cast<int>(Phase::GetMute)]),
+         TicksToMs(ep.times.ticks[static_cast<int>(Phase::SetMute)]));
+   }
+}
+
+static void PrintTimingsJson(LONGLONG totalTicks)
+{
+   const int phaseCount = static_cast<int>(Phase::Count);
+
+   std::wstring json = L"{\"phases\":{";
+   wchar_t number[64];
+   for (int phase = 0; phase < phaseCount; ++phase) {
+      LONGLONG ticks = 0;
+      ULONG calls = 0;
+      SumPhase(phase, ticks, calls);
+      swprintf(
+         number, 64, L"%ls\"%ls\":{\"calls\":%lu,\"ms\":%.3f}",
+         (phase > 0) ? L"," : L"", phaseKeys_[phase],
+         calls, TicksToMs(ticks));
+      json += number;
+   }
+   swprintf(
+      number, 64, L"},\"total_ms\":%.3f,\"activations\":%lu,\"avoided\":%lu",
+      TicksToMs(totalTicks), activationStats_.activated.load(),
+      activationStats_.avoided.load());
+   json += number;
+   if (firstSilenceTicks_ != 0) {
+      swprintf(
+         number, 64, L",\"first_silence_ms\":%.3f",
+         TicksToMs(firstSilenceTicks_));
+      json += number;
+   }
+
+   if (!opts_.channels.empty()) {
+      swprintf(
+         number, 64, L",\"level_kernel\":\"%ls\"", levelKernels_.name);
+      json += number;
+   }
+   if (fadeStats_.ticks != 0) {
+      swprintf(
+         number, 64, L",\"fade\":{\"ticks\":%lu,\"jitter_ms\":%.3f,",
+         fadeStats_.ticks, TicksToMs(fadeStats_.jitter) / fadeStats_.ticks);
+      json += number;
+      swprintf(
+         number, 64, L"\"max_jitter_ms\":%.3f}",
+         TicksToMs(fadeStats_.maxJitter));
+      json += number;
+   }
+
+   if (enforceStats_.reactions != 0) {
+      swprintf(
+         number, 64, L",\"enforce\":{\"reactions\":%lu,\"latency_ms\":%.3f,",
+         enforceStats_.reactions,
+         TicksToMs(enforceStats_.latency) / enforceStats_.reactions);
+      json += number;
+      swprintf(
+         number, 64, L"\"max_latency_ms\":%.3f}",
+         TicksToMs(enforceStats_.maxLatency));
+      json += number;
+   }
+
+   if (arrivalLatency_.count != 0) {
+      swprintf(
+         number, 64, L",\"arrivals\":{\"count\":%lu,\"max_ms\":%.3f,",
+         arrivalLatency_.count, TicksToMs(arrivalLatency_.max));
+      json += number;
+      swprintf(
+         number, 64, L"\"first_bound_us\":%lld,\"buckets\":[",
+         LatencyHistogram::firstBoundUs);
+      json += number;
+      for (int i = 0; i < LatencyHistogram::bucketCount; ++i) {
+         swprintf(
+            number, 64, L"%ls%lu",
+            (i > 0) ? L"," : L"", arrivalLatency_.buckets[i]);
+         json += number;
+      }
+      json += L"]}";
+   }
+
+   if (opts_.pipeline) {
+      json += L",\"pipeline\":{";
+      for (int stage = 0; stage < pipelineStageCount_; ++stage) {
+         const PipelineStats& stats = pipelineStats_[stage];
+         swprintf(
+            number, 64, L"%ls\"%ls\":{\"depth\":%zu,",
+            (stage > 0) ? L"," : L"", pipelineStageNames_[stage],
+            stats.maxDepth);
+         json += number;
+         swprintf(
+            number, 64, L"\"in_wait_ms\":%.3f,\"out_wait_ms\":%.3f}",
+            TicksToMs(stats.inputStall), TicksToMs(stats.outputStall));
+         json += number;
+      }
+      json += L"}";
+   }
+
+   json += L",\"endpoints\":[";
+   for (size_t i = 0; i < endpointTimes_.size(); ++i) {
+      const EndpointTimes& ep = endpointTimes_[i];
+      json += (i > 0) ? L",{\"name\":\"" : L"{\"name\":\"";
+      json += JsonEscape(ep.name);
+      swprintf(number, 64, L"\",\"ms\":%.3f", TicksToMs(ep.ticks));
+      json += number;
+      for (int phase = 0; phase < phaseCount; ++phase) {
+         if (ep.times.calls[phase] == 0) {
+            continue;
+         }
+         swprintf(
+            number, 64, L",\"%ls\":%.3f",
+            phaseKeys_[phase], TicksToMs(ep.times.ticks[phase]));
+         json += number;
+      }
+      json += L"}";
+   }
+   json += L"]}";
+   Print(L"%ls", json.c_str());
+}
+
+/* Writes all recorded events in the Chrome trace event format */
+static void WriteTrace()
+{
+   FILE* file = nullptr;
+   if (fopen_s(&file, opts_.tracePath.c_str(), "wb") != 0 || file == nullptr) {
+      PrintError(L"Failed to open trace file");
+      return;
+   }
+
+   const DWORD pid = GetCurrentProcessId();
+   const double usPerTick = 1000000.0 / ticksPerSecond_;
+   bool first = true;
+   fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+   std::lock_guard<std::mutex> guard(traceLock_);
+   for (const auto& ring : traceRings_) {
+      const size_t count = std::min(ring->count, TraceRing::capacity);
+      for (size_t i = ring->count - count; i < ring->count; ++i) {
+         const TraceEvent& ev = ring->events[i % TraceRing::capacity];
+         fprintf(
+            file,
+            "%s\n{\"name\":\"%ls\",\"cat\":\"backend\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu",
+            first ? "" : ",",
+            phaseNames_[static_cast<int>(ev.phase)],
+            (ev.start - startTicks_) * usPerTick,
+            (ev.end - ev.start) * usPerTick,
+            pid, ring->threadId);
+         if (ev.endpoint < endpointTimes_.size()) {
+            fprintf(
+               file, ",\"args\":{\"endpoint\":\"%ls\",\"thread\":%lu}",
+               JsonEscape(endpointTimes_[ev.endpoint].name).c_str(),
+               ring->threadId);
+         } else {
+            fprintf(file, ",\"args\":{\"thread\":%lu}", ring->threadId);
+         }
+         fputs("}", file);
+         first = false;
+      }
+   }
+   fputs("\n]}\n", file);
+   if (fclose(file) != 0) {
+      PrintError(L"Failed to write trace file");
+   }
+}
+
+static void PrintTimings()
+{
+   const LONGLONG totalTicks = Now() - startTicks_;
+   if (opts_.timingsJson) {
+      PrintTimingsJson(totalTicks);
+   } else {
+      PrintTimingsTable(totalTicks);
+   }
+}
+
+/* =============================================================================
+ *  Pipeline
+ */
+
+/* A fixed-capacity queue between two pipeline stages. It keeps track of how
+ * deep it got and how long either side had to wait for the other. */
+template <typename T>
+class BoundedQueue {
+public:
+   explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity)
+   {
+   }
+
+   void Push(T item)
+   {
+      std::unique_lock<std::mutex> guard(lock_);
+      if (items_.size() >= capacity_) {
+         const LONGLONG start = Now();
+         notFull_.wait(guard, [this] { return items_.size() < capacity_; });
+         pushStall_ += Now() - start;
+      }
+      items_.push_back(item);
+      maxDepth_ = std::max(maxDepth_, items_.size());
+      notEmpty_.notify_one();
+   }
+
+   /* Returns false once the queue is closed and drained */
+   bool Pop(T& item)
+   {
+      std::unique_lock<std::mutex> guard(lock_);
+      if (items_.empty() && !closed_) {
+         const LONGLONG start = Now();
+         notEmpty_.wait(guard, [this] { return !items_.empty() || closed_; });
+         popStall_ += Now() - start;
+      }
+      if (items_.empty()) {
+         return false;
+      }
+      item = items_.front();
+      items_.pop_front();
+      notFull_.notify_one();
+      return true;
+   }
+
+   void Close()
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      closed_ = true;
+      notEmpty_.notify_all();
+   }
+
+   size_t MaxDepth() const { return maxDepth_; }
+   LONGLONG PushStall() const { return pushStall_; }
+   LONGLONG PopStall() const { return popStall_; }
+
+private:
+   const size_t capacity_;
+   std::mutex lock_;
+   std::condition_variable notFull_;
+   std::condition_variable notEmpty_;
+   std::deque<T> items_;
+   bool closed_ = false;
+   size_t maxDepth_ = 0;
+   LONGLONG pushStall_ = 0;
+   LONGLONG popStall_ = 0;
+};
+
+/* =============================================================================
+ *  Filter
+ */
+
+GlobPattern::GlobPattern(const std::wstring& pattern)
+{
+   pattern_.reserve(pattern.size());
+   for (wchar_t c : pattern) {
+      /* Runs of '*' match the same as a single one */
+      if (c == L'*' && !pattern_.empty() && pattern_.back() == L'*') {
+         continue;
+      }
+      pattern_.push_back(towlower(c));
+   }
+}
+
+/* Greedy matching that only ever backtracks to the last '*', which keeps it
+ * linear for the patterns that matter */
+bool GlobPattern::Match(const wchar_t* text) const
+{
+   const wchar_t* p = pattern_.c_str();
+   const wchar_t* star = nullptr;
+   const wchar_t* resume = nullptr;
+   while (*text != L'\0') {
+      if (*p == L'*') {
+         star = ++p;
+         resume = text;
+      } else if (*p != L'\0' && (*p == L'?' || *p == towlower(*text))) {
+         ++p;
+         ++text;
+      } else if (star != nullptr) {
+         p = star;
+         text = ++resume;
+      } else {
+         return false;
+      }
+   }
+   while (*p == L'*') {
+      ++p;
+   }
+   return *p == L'\0';
+}
+
+/* Parses FIELD:PATTERN */
+bool DeviceFilter::Add(const std::wstring& rule, bool exclude)
+{
+   const size_t separator = rule.find(L':');
+   if (separator == std::wstring::npos) {
+      return false;
+   }
+   const std::wstring field = rule.substr(0, separator);
+   for (int i = 0; i < static_cast<int>(FilterField::Count); ++i) {
+      if (_wcsicmp(field.c_str(), filterFieldKeys_[i]) == 0) {
+         rules_.push_back({
+            static_cast<FilterField>(i), exclude,
+            GlobPattern(rule.substr(separator + 1)) });
+         return true;
+      }
+   }
+   return false;
+}
+
+std::wstring DeviceFilter::Key() const
+{
+   std::vector<std::wstring> rules;
+   for (const FilterRule& rule : rules_) {
+      rules.push_back(
+         std::wstring(rule.exclude ? L"-" : L"+")
+         + filterFieldKeys_[static_cast<int>(rule.field)] + L":"
+         + rule.pattern.Pattern());
+   }
+   std::sort(rules.begin(), rules.end());
+   std::wstring key;
+   for (const std::wstring& rule : rules) {
+      key += rule;
+      key += L'\n';
+   }
+   return key;
+}
+
+bool DeviceFilter::Needs(FilterField field) const
+{
+   return std::any_of(rules_.begin(), rules_.end(),
+      [field](const FilterRule& rule) { return rule.field == field; });
+}
+
+FilterResult DeviceFilter::Evaluate(const wchar_t* const* values) const
+{
+   bool hasInclude = false;
+   bool included = false;
+   bool unknown = false;
+   for (const FilterRule& rule : rules_) {
+      const wchar_t* value = values[static_cast<int>(rule.field)];
+      hasInclude |= !rule.exclude;
+      if (value == nullptr) {
+         unknown = true;
+      } else if (rule.pattern.Match(value)) {
+         if (rule.exclude) {
+            return FilterResult::Excluded;
+         }
+         included = true;
+      }
+   }
+   if (unknown) {
+      return FilterResult::Undecided;
+   }
+   return (included || !hasInclude) ? FilterResult::Included
+                                    : FilterResult::Excluded;
+}
+
+/* =============================================================================
+ *  Endpoint Handle
+ */
+
+void EndpointHandle::Reset(IMMDevicePtr device)
+{
+   activationStats_.avoided += Unused();
+   device_ = device;
+   propStore_ = nullptr;
+   volume_ = nullptr;
+   sessionManager_ = nullptr;
+}
+
+HRESULT EndpointHandle::PropertyStore(IPropertyStorePtr& propStore)
+{
+   if (!propStore_) {
+      const HRESULT hr = device_->OpenPropertyStore(STGM_READ, &propStore_);
+      if (FAILED(hr)) {
+         return hr;
+      }
+      ++activationStats_.activated;
+   }
+   propStore = propStore_;
+   return S_OK;
+}
+
+HRESULT EndpointHandle::Volume(IAudioEndpointVolumePtr& endpointVolume)
+{
+   if (!volume_) {
+      const HRESULT hr = device_->Activate(
+         __uuidof(IAudioEndpointVolume), CLSCTX_INPROC_SERVER,
+         nullptr, reinterpret_cast<LPVOID*>(&volume_));
+      if (FAILED(hr)) {
+         return hr;
+      }
+      ++activationStats_.activated;
+   }
+   endpointVolume = volume_;
+   return S_OK;
+}
+
+HRESULT EndpointHandle::SessionManager(IAudioSessionManager2Ptr& sessionManager)
+{
+   if (!sessionManager_) {
+      const HRESULT hr = device_->Activate(
+         __uuidof(IAudioSessionManager2), CLSCTX_INPROC_SERVER,
+         nullptr, reinterpret_cast<LPVOID*>(&sessionManager_));
+      if (FAILED(hr)) {
+         return hr;
+      }
+      ++activationStats_.activated;
+   }
+   sessionManager = sessionManager_;
+   return S_OK;
+}
+
+ULONG EndpointHandle::Unused() const
+{
+   if (!device_) {
+      return 0;
+   }
+   return static_cast<ULONG>(!propStore_ + !volume_ + !sessionManager_);
+}
+
+/* =============================================================================
+ *  Sessions
+ */
+
+/* Returns the lowercase executable name of a process. Names are cached, so
+ * a process with sessions on many endpoints is only opened once. */
+static std::wstring ProcessName(DWORD pid)
+{
+   {
+      std::lock_guard<std::mutex> guard(processNamesLock_);
+      auto it = processNames_.find(pid);
+      if (it != processNames_.end()) {
+         return it->second;
+      }
+   }
+
+   std::wstring name;
+   HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+   if (process != nullptr) {
+      wchar_t path[MAX_PATH];
+      DWORD size = MAX_PATH;
+      if (QueryFullProcessImageNameW(process, 0, path, &size)) {
+         const wchar_t* base = wcsrchr(path, L'\\');
+         name = (base != nullptr) ? base + 1 : path;
+         for (wchar_t& c : name) {
+            c = static_cast<wchar_t>(towlower(c));
+         }
+      }
+      CloseHandle(process);
+   }
+
+   std::lock_guard<std::mutex> guard(processNamesLock_);
+   processNames_.emplace(pid, name);
+   return name;
+}
+
+HRESULT SessionTable::Load(IAudioSessionManager2Ptr sessionManager)
+{
+   IAudioSessionEnumeratorPtr sessionEnumerator;
+   HRESULT hr = sessionManager->GetSessionEnumerator(&sessionEnumerator);
+   if (FAILED(hr)) {
+      return hr;
+   }
+   int count = 0;
+   hr = sessionEnumerator->GetCount(&count);
+   if (FAILED(hr)) {
+      return hr;
+   }
+
+   const bool byName = std::any_of(opts_.apps.begin(), opts_.apps.end(),
+      [](const AppTarget& target) { return !target.exe.empty(); });
+   sessions_.reserve(count);
+   for (int i = 0; i < count; ++i) {
+      IAudioSessionControlPtr control;
+      IAudioSessionControl2Ptr control2;
+      ISimpleAudioVolumePtr volume;
+      DWORD pid = 0;
+      if (FAILED(sessionEnumerator->GetSession(i, &control))
+          || FAILED(control.QueryInterface(
+               __uuidof(IAudioSessionControl2), &control2))
+          || FAILED(control2->GetProcessId(&pid))
+          || FAILED(control.QueryInterface(
+               __uuidof(ISimpleAudioVolume), &volume))) {
+         continue;
+      }
+
+      const size_t index = sessions_.size();
+      sessions_.push_back({ pid, volume });
+      byPid_.emplace(pid, index);
+      if (byName && pid != 0) {
+         byName_.emplace(ProcessName(pid), index);
+      }
+   }
+   return S_OK;
+}
+
+std::vector<ISimpleAudioVolumePtr> SessionTable::Match(
+   const std::vector<AppTarget>& targets) const
+{
+   std::vector<size_t> indices;
+   auto collect = [&indices](auto range) {
+      for (auto it = range.first; it != range.second; ++it) {
+         indices.push_back(it->second);
+      }
+   };
+   for (const AppTarget& target : targets) {
+      if (target.exe.empty()) {
+         collect(byPid_.equal_range(target.pid));
+      } else {
+         collect(byName_.equal_range(target.exe));
+      }
+   }
+   std::sort(indices.begin(), indices.end());
+   indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+   std::vector<ISimpleAudioVolumePtr> matched;
+   matched.reserve(indices.size());
+   for (size_t index : indices) {
+      matched.push_back(sessions_[index].volume);
+   }
+   return matched;
+}
+
+/* =============================================================================
+ *  State File
+ */
+
+/* FNV-1a over the UTF-16 code units of an endpoint ID */
+static ULONGLONG HashId(const std::wstring& id)
+{
+   ULONGLONG hash = 0xcbf29ce484222325ULL;
+   for (wchar_t c : id) {
+      hash = (hash ^ static_cast<ULONGLONG>(c)) * 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+static const StateEntry* FindSavedState(const std::wstring& id)
+{
+   const ULONGLONG hash = HashId(id);
+   auto it = std::lower_bound(
+      savedState_.begin(), savedState_.end(), hash,
+      [](const StateEntry& entry, ULONGLONG h) { return entry.idHash < h; });
+   return (it != savedState_.end() && it->idHash == hash) ? &*it : nullptr;
+}
+
+/* Writes the state every endpoint had before the action was applied */
+static bool SaveState(const std::vector<Endpoint>& endpoints)
+{
+   std::vector<StateEntry> entries;
+   entries.reserve(endpoints.size());
+   for (const Endpoint& ep : endpoints) {
+      if (!ep.id.empty() && (ep.status == EndpointStatus::Unchanged
+                             || ep.status == EndpointStatus::Changed)) {
+         entries.push_back({ HashId(ep.id), ep.wasMuted ? 1u : 0u, ep.volume });
+      }
+   }
+   std::sort(entries.begin(), entries.end(),
+      [](const StateEntry& a, const StateEntry& b) {
+         return a.idHash < b.idHash;
+      });
+   entries.erase(
+      std::unique(entries.begin(), entries.end(),
+         [](const StateEntry& a, const StateEntry& b) {
+            return a.idHash == b.idHash;
+         }),
+      entries.end());
+
+   const StateHeader header = {
+      stateMagic_, stateVersion_, static_cast<DWORD>(entries.size()), 0
+   };
+   FILE* file = nullptr;
+   if (fopen_s(&file, opts_.statePath.c_str(), "wb") != 0 || file == nullptr) {
+      PrintError(L"Failed to open state file");
+      return false;
+   }
+   const bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(entries.data(), sizeof(StateEntry), entries.size(), file)
+         == entries.size();
+   if (fclose(file) != 0 || !written) {
+      PrintError(L"Failed to write state file");
+      return false;
+   }
+   return true;
+}
+
+/* Maps the state file for -restore, its entries are looked up in place */
+static bool MapState(HANDLE& mapping, const void*& view)
+{
+   HANDLE file = CreateFileA(
+      opts_.statePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+   if (file == INVALID_HANDLE_VALUE) {
+      PrintError(L"Failed to open state file");
+      return false;
+   }
+   LARGE_INTEGER size = { 0 };
+   GetFileSizeEx(file, &size);
+   mapping = (size.QuadPart >= static_cast<LONGLONG>(sizeof(StateHeader)))
+      ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+      : nullptr;
+   CloseHandle(file);
+   view = (mapping != nullptr)
+      ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+      : nullptr;
+
+   const StateHeader* header = static_cast<const StateHeader*>(view);
+   if (header == nullptr || header->magic != stateMagic_
+       || header->version != stateVersion_
+       || static_cast<ULONGLONG>(size.QuadPart) < sizeof(StateHeader)
+          + static_cast<ULONGLONG>(header->count) * sizeof(StateEntry)) {
+      PrintError(L"Invalid state file");
+      return false;
+   }
+   savedState_ = std::span<const StateEntry>(
+      reinterpret_cast<const StateEntry*>(header + 1), header->count);
+   return true;
+}
+
+static void UnmapState(HANDLE mapping, const void* view)
+{
+   savedState_ = std::span<const StateEntry>();
+   if (view != nullptr) {
+      UnmapViewOfFile(view);
+   }
+   if (mapping != nullptr) {
+      CloseHandle(mapping);
+   }
+}
+
+/* =============================================================================
+ *  Cache
+ */
+
+/* Identifies the set of endpoints, whatever order they are enumerated in */
+static ULONGLONG FingerprintEndpoints(std::span<const Endpoint> endpoints)
+{
+   std::vector<ULONGLONG> hashes;
+   hashes.reserve(endpoints.size());
+   for (const Endpoint& ep : endpoints) {
+      hashes.push_back(HashId(ep.id));
+   }
+   std::sort(hashes.begin(), hashes.end());
+   ULONGLONG fingerprint = 0xcbf29ce484222325ULL;
+   for (ULONGLONG hash : hashes) {
+      fingerprint = (fingerprint ^ hash) * 0x100000001b3ULL;
+   }
+   return fingerprint;
+}
+
+static const CacheEntry* FindCacheEntry(
+   const DeviceCache& cache,
+   const std::wstring& id)
+{
+   const ULONGLONG hash = HashId(id);
+   auto it = std::lower_bound(
+      cache.entries.begin(), cache.entries.end(), hash,
+      [](const CacheEntry& entry, ULONGLONG h) { return entry.idHash < h; });
+   return (it != cache.entries.end() && it->idHash == hash) ? &*it : nullptr;
+}
+
+/* A missing or unusable cache file is no error, the cache just stays empty */
+static void LoadCache(DeviceCache& cache)
+{
+   FILE* file = nullptr;
+   if (fopen_s(&file, opts_.cachePath.c_str(), "rb") != 0 || file == nullptr) {
+      return;
+   }
+   CacheHeader header = { 0 };
+   bool valid = fread(&header, sizeof(header), 1, file) == 1
+      && header.magic == cacheMagic_ && header.version == cacheVersion_
+      && header.count <= 0x10000 && header.nameChars <= 0x1000000;
+   if (valid) {
+      cache.entries.resize(header.count);
+      cache.names.resize(header.nameChars);
+      valid = fread(cache.entries.data(), sizeof(CacheEntry), header.count,
+                    file) == header.count
+         && fread(cache.names.data(), sizeof(wchar_t), header.nameChars,
+                  file) == header.nameChars;
+   }
+   fclose(file);
+
+   for (const CacheEntry& entry : cache.entries) {
+      valid = valid && entry.nameOffset <= header.nameChars
+         && entry.nameLength <= header.nameChars - entry.nameOffset;
+   }
+   if (!valid) {
+      cache.entries.clear();
+      cache.names.clear();
+      return;
+   }
+   cache.fingerprint = header.fingerprint;
+}
+
+static DWORD PhaseUs(const PhaseTimes& times, Phase phase)
+{
+   return static_cast<DWORD>(
+      TicksToUs(times.ticks[static_cast<int>(phase)]));
+}
+
+/* Writes what this run learned, keeping the entries of the endpoints it did
+ * not get to. Failing to do so only costs the next run some time. */
+static void SaveCache(
+   const DeviceCache& cache,
+   std::span<const Endpoint> endpoints)
+{
+   std::vector<CacheEntry> entries;
+   std::wstring names;
+   entries.reserve(endpoints.size());
+   for (const Endpoint& ep : endpoints) {
+      const CacheEntry* old = ep.cached;
+      CacheEntry entry = { 0 };
+      if (!ep.id.empty() && !ep.name.empty()
+          && (ep.status == EndpointStatus::Unchanged
+              || ep.status == EndpointStatus::Changed)) {
+         const ULONG* calls = ep.times.calls;
+         entry.idHash = HashId(ep.id);
+         entry.muted = ep.muted ? 1u : 0u;
+         entry.flow = static_cast<DWORD>(ep.flow);
+         entry.nameUs = (calls[static_cast<int>(Phase::PropertyStore)] != 0)
+            ? PhaseUs(ep.times, Phase::PropertyStore)
+            : (old != nullptr) ? old->nameUs : 0;
+         entry.probeUs = (calls[static_cast<int>(Phase::GetMute)] != 0)
+            ? PhaseUs(ep.times, Phase::Activate)
+               + PhaseUs(ep.times, Phase::GetMute)
+            : (old != nullptr) ? old->probeUs : 0;
+      } else if (old != nullptr) {
+         entry = *old;
+      } else {
+         continue;
+      }
+      const size_t offset = names.size();
+      if (ep.name.empty()) {
+         names.append(cache.names, old->nameOffset, old->nameLength);
+      } else {
+         names += ep.name;
+      }
+      entry.nameOffset = static_cast<DWORD>(offset);
+      entry.nameLength = static_cast<DWORD>(names.size() - offset);
+      entries.push_back(entry);
+   }
+   std::sort(entries.begin(), entries.end(),
+      [](const CacheEntry& a, const CacheEntry& b) {
+         return a.idHash < b.idHash;
+      });
+   entries.erase(
+      std::unique(entries.begin(), entries.end(),
+         [](const CacheEntry& a, const CacheEntry& b) {
+            return a.idHash == b.idHash;
+         }),
+      entries.end());
+
+   const CacheHeader header = {
+      cacheMagic_, cacheVersion_, cache.fingerprint,
+      static_cast<DWORD>(entries.size()), static_cast<DWORD>(names.size())
+   };
+   FILE* file = nullptr;
+   if (fopen_s(&file, opts_.cachePath.c_str(), "wb") != 0 || file == nullptr) {
+      PrintError(L"Failed to open cache file");
+      return;
+   }
+   const bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(entries.data(), sizeof(CacheEntry), entries.size(), file)
+         == entries.size()
+      && fwrite(names.data(), sizeof(wchar_t), names.size(), file)
+         == names.size();
+   if (fclose(file) != 0 || !written) {
+      PrintError(L"Failed to write cache file");
+   }
+}
+
+/* =============================================================================
+ *  Name Cache
+ */
+
+void NameCache::Open(const std::string& path)
+{
+   path_ = path;
+   Map();
+}
+
+void NameCache::Close()
+{
+   Save();
+   Unmap();
+}
+
+void NameCache::Map()
+{
+   HANDLE file = CreateFileA(
+      path_.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+   if (file == INVALID_HANDLE_VALUE) {
+      return;
+   }
+   LARGE_INTEGER size = { 0 };
+   GetFileSizeEx(file, &size);
+   mapping_ = (size.QuadPart >= static_cast<LONGLONG>(sizeof(NameCacheHeader)))
+      ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+      : nullptr;
+   CloseHandle(file);
+   view_ = (mapping_ != nullptr)
+      ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)
+      : nullptr;
+
+   /* An unusable file is no error, it is just written anew */
+   const NameCacheHeader* header = static_cast<const NameCacheHeader*>(view_);
+   if (header == nullptr || header->magic != nameCacheMagic_
+       || header->version != nameCacheVersion_
+       || static_cast<ULONGLONG>(size.QuadPart) < sizeof(NameCacheHeader)
+          + static_cast<ULONGLONG>(header->count) * sizeof(NameEntry)
+          + static_cast<ULONGLONG>(header->nameChars) * sizeof(wchar_t)) {
+      Unmap();
+      return;
+   }
+   entries_ = std::span<const NameEntry>(
+      reinterpret_cast<const NameEntry*>(header + 1), header->count);
+   names_ = reinterpret_cast<const wchar_t*>(
+      entries_.data() + entries_.size());
+   nameChars_ = header->nameChars;
+}
+
+void NameCache::Unmap()
+{
+   entries_ = std::span<const NameEntry>();
+   names_ = nullptr;
+   nameChars_ = 0;
+   if (view_ != nullptr) {
+      UnmapViewOfFile(view_);
+      view_ = nullptr;
+   }
+   if (mapping_ != nullptr) {
+      CloseHandle(mapping_);
+      mapping_ = nullptr;
+   }
+}
+
+bool NameCache::Find(const std::wstring& id, std::wstring& name)
+{
+   if (path_.empty() || id.empty()) {
+      return false;
+   }
+   const ULONGLONG hash = HashId(id);
+   std::lock_guard<std::mutex> guard(lock_);
+   auto change = changes_.find(hash);
+   if (change != changes_.end()) {
+      name = change->second;
+      return !name.empty();
+   }
+   auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), hash,
+      [](const NameEntry& entry, ULONGLONG h) { return entry.idHash < h; });
+   if (it == entries_.end() || it->idHash != hash
+       || it->nameOffset > nameChars_
+       || it->nameLength > nameChars_ - it->nameOffset) {
+      return false;
+   }
+   name.assign(names_ + it->nameOffset, it->nameLength);
+   return !name.empty();
+}
+
+void NameCache::Add(const std::wstring& id, const std::wstring& name)
+{
+   if (path_.empty() || id.empty()) {
+      return;
+   }
+   std::lock_guard<std::mutex> guard(lock_);
+   changes_[HashId(id)] = name;
+}
+
+void NameCache::Invalidate(const std::wstring& id)
+{
+   Add(id, std::wstring());
+}
+
+/* Merges the changes into the mapped entries and replaces the file, which
+ * has to be unmapped for that and is mapped again afterwards */
+void NameCache::Save()
+{
+   std::lock_guard<std::mutex> guard(lock_);
+   if (changes_.empty()) {
+      return;
+   }
+   std::vector<std::pair<ULONGLONG, std::wstring>> merged;
+   for (const NameEntry& entry : entries_) {
+      if (changes_.count(entry.idHash) == 0
+          && entry.nameOffset <= nameChars_
+          && entry.nameLength <= nameChars_ - entry.nameOffset) {
+         merged.emplace_back(
+            entry.idHash,
+            std::wstring(names_ + entry.nameOffset, entry.nameLength));
+      }
+   }
+   for (const auto& change : changes_) {
+      if (!change.second.empty()) {
+         merged.push_back(change);
+      }
+   }
+   changes_.clear();
+   std::sort(merged.begin(), merged.end());
+
+   std::vector<NameEntry> entries;
+   std::wstring names;
+   std::unordered_map<std::wstring, DWORD> interned;
+   entries.reserve(merged.size());
+   for (const auto& [hash, name] : merged) {
+      auto it = interned.emplace(name, static_cast<DWORD>(names.size()));
+      if (it.second) {
+         names += name;
+      }
+      entries.push_back({
+         hash, it.first->second, static_cast<DWORD>(name.size()) });
+   }
+
+   const NameCacheHeader header = {
+      nameCacheMagic_, nameCacheVersion_,
+      static_cast<DWORD>(entries.size()), static_cast<DWORD>(names.size())
+   };
+   Unmap();
+   FILE* file = nullptr;
+   if (fopen_s(&file, path_.c_str(), "wb") != 0 || file == nullptr) {
+      PrintError(L"Failed to open name cache file");
+      return;
+   }
+   const bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(entries.data(), sizeof(NameEntry), entries.size(), file)
+         == entries.size()
+      && fwrite(names.data(), sizeof(wchar_t), names.size(), file)
+         == names.size();
+   if (fclose(file) != 0 || !written) {
+      PrintError(L"Failed to write name cache file");
+      return;
+   }
+   Map();
+}
+
+/* =============================================================================
+ *  Channel Levels
+ */
+
+/* Compares like the vector min and max, which take the second operand
+ * unless the first one is greater or less, so that -0 and NaN come out of
+ * every variant alike */
+static float ClampLevel(float level)
+{
+   const float floored = (level > 0.0f) ? level : 0.0f;
+   return (floored < 1.0f) ? floored : 1.0f;
+}
+
+static void ScaleLevelsScalar(
+   const float* levels,
+   const float* gains,
+   float* out,
+   size_t count)
+{
+   for (size_t i = 0; i < count; ++i) {
+      out[i] = ClampLevel(levels[i] * gains[i]);
+   }
+}
+
+static void LerpLevelsScalar(
+   const float* to,
+   const float* from,
+   float t,
+   float* out,
+   size_t count)
+{
+   for (size_t i = 0; i < count; ++i) {
+      out[i] = ClampLevel(to[i] + (from[i] - to[i]) * t);
+   }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* The vector variants do the same operations in the same order as the
+ * scalar ones, so all of them give identical results. The tails go through
+ * the scalar code. */
+
+static void ScaleLevelsSse2(
+   const float* levels,
+   const float* gains,
+   float* out,
+   size_t count)
+{
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.0f);
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      const __m128 v = _mm_mul_ps(
+         _mm_loadu_ps(levels + i), _mm_loadu_ps(gains + i));
+      _mm_storeu_ps(out + i, _mm_min_ps(_mm_max_ps(v, zero), one));
+   }
+   ScaleLevelsScalar(levels + i, gains + i, out + i, count - i);
+}
+
+static void LerpLevelsSse2(
+   const float* to,
+   const float* from,
+   float t,
+   float* out,
+   size_t count)
+{
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.0f);
+   const __m128 factor = _mm_set1_ps(t);
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      const __m128 a = _mm_loadu_ps(to + i);
+      const __m128 b = _mm_loadu_ps(from + i);
+      const __m128 v = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), factor));
+      _mm_storeu_ps(out + i, _mm_min_ps(_mm_max_ps(v, zero), one));
+   }
+   LerpLevelsScalar(to + i, from + i, t, out + i, count - i);
+}
+
+static void ScaleLevelsAvx(
+   const float* levels,
+   const float* gains,
+   float* out,
+   size_t count)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      const __m256 v = _mm256_mul_ps(
+         _mm256_loadu_ps(levels + i), _mm256_loadu_ps(gains + i));
+      _mm256_storeu_ps(out + i, _mm256_min_ps(_mm256_max_ps(v, zero), one));
+   }
+   ScaleLevelsSse2(levels + i, gains + i, out + i, count - i);
+}
+
+static void LerpLevelsAvx(
+   const float* to,
+   const float* from,
+   float t,
+   float* out,
+   size_t count)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 factor = _mm256_set1_ps(t);
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      const __m256 a = _mm256_loadu_ps(to + i);
+      const __m256 b = _mm256_loadu_ps(from + i);
+      const __m256 v = _mm256_add_ps(
+         a, _mm256_mul_ps(_mm256_sub_ps(b, a), factor));
+      _mm256_storeu_ps(out + i, _mm256_min_ps(_mm256_max_ps(v, zero), one));
+   }
+   LerpLevelsSse2(to + i, from + i, t, out + i, count - i);
+}
+
+/* AVX needs the OS to save the YMM registers as well */
+static bool HasAvx()
+{
+   int info[4];
+   __cpuid(info, 1);
+   const bool osxsave = (info[2] & (1 << 27)) != 0;
+   const bool avx = (info[2] & (1 << 28)) != 0;
+   return osxsave && avx && (_xgetbv(0) & 6) == 6;
+}
+
+static bool HasSse2()
+{
+   int info[4];
+   __cpuid(info, 1);
+   return (info[3] & (1 << 26)) != 0;
+}
+
+#endif
+
+static void SelectLevelKernels()
+{
+#ifdef HAVE_X86_KERNELS
+   if (HasAvx()) {
+      levelKernels_ = { L"avx", ScaleLevelsAvx, LerpLevelsAvx };
+      return;
+   }
+   if (HasSse2()) {
+      levelKernels_ = { L"sse2", ScaleLevelsSse2, LerpLevelsSse2 };
+      return;
+   }
+#endif
+   levelKernels_ = { L"scalar", ScaleLevelsScalar, LerpLevelsScalar };
+}
+
+/* =============================================================================
+ *  Fade
+ */
+
+/* Gain for every tick of a fade out, falling linearly in dB down to the
+ * floor and to silence on the last tick. A fade in walks it backwards. */
+static void BuildFadeCurve()
+{
+   const size_t ticks = std::max<size_t>(1, opts_.fadeMs / fadeTickMs_);
+   fadeCurve_.resize(ticks + 1);
+   for (size_t i = 0; i < ticks; ++i) {
+      const double db = fadeFloorDb_ * static_cast<double>(i) / ticks;
+      fadeCurve_[i] = static_cast<float>(std::pow(10.0, db / 20.0));
+   }
+   fadeCurve_[ticks] = 0.0f;
+}
+
+/* Hands the endpoint over to the fade scheduler, which sets its final
+ * status once the ramp is done */
+static void ScheduleFade(IAudioEndpointVolumePtr ev, Endpoint& ep, bool mute)
+{
+   ep.status = EndpointStatus::Fading;
+   std::lock_guard<std::mutex> guard(fadeLock_);
+   fades_.push_back({ &ep, ev, ep.volume, mute });
+}
+
+static void ScheduleChannelFade(
+   IAudioEndpointVolumePtr ev,
+   Endpoint& ep,
+   std::vector<UINT>&& channels,
+   std::vector<float>&& from,
+   std::vector<float>&& to)
+{
+   ep.status = EndpointStatus::Fading;
+   std::lock_guard<std::mutex> guard(fadeLock_);
+   fades_.push_back({
+      &ep, ev, ep.volume, false,
+      std::move(channels), std::move(from), std::move(to) });
+}
+
+static void WaitUntil(HANDLE timer, LONGLONG due)
+{
+   const LONGLONG remaining = due - Now();
+   if (remaining <= 0) {
+      return;
+   }
+   LARGE_INTEGER dueTime;
+   dueTime.QuadPart = -(remaining * 10000000 / ticksPerSecond_);
+   if (timer != nullptr
+       && SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE)) {
+      WaitForSingleObject(timer, INFINITE);
+   } else {
+      Sleep(static_cast<DWORD>(remaining * 1000 / ticksPerSecond_));
+   }
+}
+
+static HRESULT SetFadeLevel(Fade& fade, float level)
+{
+   PhaseSpan span(Phase::Volume, fade.ep);
+   const HRESULT hr = fade.volume->SetMasterVolumeLevelScalar(
+      level, &eventContext_);
+   if (FAILED(hr)) {
+      fade.ep->hr = hr;
+      fade.ep->status = EndpointStatus::SetVolumeFailed;
+   }
+   return hr;
+}
+
+static HRESULT SetFadeMute(Fade& fade)
+{
+   PhaseSpan span(Phase::SetMute, fade.ep);
+   const HRESULT hr = fade.volume->SetMute(fade.mute, &eventContext_);
+   if (FAILED(hr)) {
+      fade.ep->hr = hr;
+      fade.ep->status = EndpointStatus::SetMuteFailed;
+   }
+   return hr;
+}
+
+static void SetFadeChannels(Fade& fade, const float* levels)
+{
+   PhaseSpan span(Phase::Volume, fade.ep);
+   for (size_t i = 0; i < fade.channels.size(); ++i) {
+      const HRESULT hr = fade.volume->SetChannelVolumeLevelScalar(
+         fade.channels[i], levels[i], &eventContext_);
+      if (FAILED(hr)) {
+         fade.ep->hr = hr;
+         fade.ep->status = EndpointStatus::SetVolumeFailed;
+         return;
+      }
+   }
+}
+
+/* Runs all scheduled fades on the calling thread. Every tick writes the
+ * level of all endpoints in one batch, so the number of endpoints does not
+ * add timers or threads. Returns the endpoints that were faded. */
+static std::vector<Endpoint*> RunFades()
+{
+   std::vector<Fade> fades;
+   {
+      std::lock_guard<std::mutex> guard(fadeLock_);
+      fades.swap(fades_);
+   }
+   std::vector<Endpoint*> finished;
+   if (fades.empty()) {
+      return finished;
+   }
+
+   auto active = [](const Fade& fade) {
+      return fade.ep->status == EndpointStatus::Fading;
+   };
+   std::vector<float> from;
+   std::vector<float> to;
+   for (Fade& fade : fades) {
+      if (!fade.channels.empty()) {
+         from.insert(from.end(), fade.from.begin(), fade.from.end());
+         to.insert(to.end(), fade.to.begin(), fade.to.end());
+      } else if (!fade.mute && SUCCEEDED(SetFadeLevel(fade, 0.0f))) {
+         SetFadeMute(fade);
+      }
+   }
+   /* The channel levels of all endpoints, computed in one batch per tick */
+   std::vector<float> levels(from.size());
+
+   HANDLE timer = CreateWaitableTimerExW(
+      nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+      TIMER_ALL_ACCESS);
+   if (timer == nullptr) {
+      /* High resolution timers need Windows 10 1803 */
+      timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+   }
+   const size_t ticks = fadeCurve_.size() - 1;
+   const LONGLONG period = ticksPerSecond_ * fadeTickMs_ / 1000;
+   const LONGLONG start = Now();
+   bool cut = false;
+   for (size_t tick = 1; tick <= ticks; ++tick) {
+      /* Rather the end state right away than a ramp the deadline cuts off */
+      if (opts_.timeoutMs != 0
+          && std::chrono::steady_clock::now()
+             + std::chrono::milliseconds(fadeTickMs_) >= deadline_) {
+         cut = true;
+         break;
+      }
+      const LONGLONG due = start + static_cast<LONGLONG>(tick) * period;
+      WaitUntil(timer, due);
+      const LONGLONG jitter = std::max<LONGLONG>(Now() - due, 0);
+      ++fadeStats_.ticks;
+      fadeStats_.jitter += jitter;
+      fadeStats_.maxJitter = std::max(fadeStats_.maxJitter, jitter);
+
+      if (!levels.empty()) {
+         levelKernels_.lerp(
+            to.data(), from.data(), fadeCurve_[tick], levels.data(),
+            levels.size());
+      }
+      size_t offset = 0;
+      for (Fade& fade : fades) {
+         if (!fade.channels.empty()) {
+            if (active(fade)) {
+               SetFadeChannels(fade, levels.data() + offset);
+            }
+            offset += fade.channels.size();
+         } else if (active(fade)) {
+            const float gain = fadeCurve_[fade.mute ? tick : ticks - tick];
+            SetFadeLevel(fade, fade.level * gain);
+         }
+      }
+   }
+   if (timer != nullptr) {
+      CloseHandle(timer);
+   }
+   for (Fade& fade : fades) {
+      if (!cut || !active(fade)) {
+         continue;
+      }
+      if (!fade.channels.empty()) {
+         SetFadeChannels(fade, fade.to.data());
+      } else if (!fade.mute) {
+         SetFadeLevel(fade, fade.level);
+      }
+   }
+
+   for (Fade& fade : fades) {
+      if (!fade.channels.empty()) {
+         if (active(fade)) {
+            fade.ep->status = EndpointStatus::Changed;
+            fade.ep->channelsChanged = static_cast<UINT>(fade.channels.size());
+         }
+         finished.push_back(fade.ep);
+         continue;
+      }
+      /* A ramp that failed part way still has to end muted */
+      if (fade.mute && fade.ep->status == EndpointStatus::SetVolumeFailed) {
+         fade.ep->status = EndpointStatus::Fading;
+      }
+      if (active(fade) && !fade.mute) {
+         fade.ep->status = EndpointStatus::Changed;
+         fade.ep->muted = FALSE;
+      } else if (active(fade) && SUCCEEDED(SetFadeMute(fade))) {
+         /* Silent from here on, even if the level below does not come back */
+         fade.ep->status = EndpointStatus::Changed;
+         fade.ep->muted = TRUE;
+         RecordSilence();
+         /* Muted at zero, put the level back for the next unmute */
+         SetFadeLevel(fade, fade.level);
+      }
+      finished.push_back(fade.ep);
+   }
+   return finished;
+}
+
+/* =============================================================================
+ *  Mute
+ */
+
+/* Puts back the saved level and mute state, each only if it differs. The
+ * level goes first, so an endpoint is never unmuted at its old level. */
+static void RestoreEndpoint(IAudioEndpointVolumePtr ev, Endpoint& ep)
+{
+   const StateEntry& saved = *ep.saved;
+   const bool restoreVolume = saved.volume >= 0.0f
+      && (ep.volume < 0.0f || std::abs(ep.volume - saved.volume) > 0.001f);
+   const BOOL muted = saved.muted ? TRUE : FALSE;
+   ep.muted = ep.wasMuted;
+   ep.status = EndpointStatus::Unchanged;
+
+   HRESULT hr;
+   if (restoreVolume) {
+      {
+         PhaseSpan span(Phase::Volume, &ep);
+         hr = ev->SetMasterVolumeLevelScalar(saved.volume, &eventContext_);
+      }
+      ep.hr = hr;
+      if (FAILED(hr)) {
+         ep.status = EndpointStatus::SetVolumeFailed;
+         return;
+      }
+      ep.volume = saved.volume;
+      ep.status = EndpointStatus::Changed;
+   }
+   if (muted != ep.wasMuted) {
+      {
+         PhaseSpan span(Phase::SetMute, &ep);
+         hr = ev->SetMute(muted, &eventContext_);
+      }
+      ep.hr = hr;
+      if (FAILED(hr)) {
+         ep.status = EndpointStatus::SetMuteFailed;
+         return;
+      }
+      ep.muted = muted;
+      ep.status = EndpointStatus::Changed;
+   }
+}
+
+/* Silences or attenuates the -channels of the endpoint, or puts them back
+ * to full level, instead of muting the endpoint as a whole */
+static void ApplyChannels(IAudioEndpointVolumePtr ev, Endpoint& ep, bool mute)
+{
+   UINT count = 0;
+   std::vector<UINT> channels;
+   std::vector<float> gains;
+   std::vector<float> levels;
+   {
+      PhaseSpan span(Phase::Volume, &ep);
+      ep.hr = ev->GetChannelCount(&count);
+      for (const ChannelRule& rule : opts_.channels) {
+         for (UINT c = rule.first; c <= rule.last && c < count; ++c) {
+            channels.push_back(c);
+            gains.push_back(rule.gain);
+         }
+      }
+      levels.resize(channels.size());
+      for (size_t i = 0; i < channels.size() && SUCCEEDED(ep.hr); ++i) {
+         ep.hr = ev->GetChannelVolumeLevelScalar(channels[i], &levels[i]);
+      }
+   }
+   if (FAILED(ep.hr)) {
+      ep.status = EndpointStatus::ChannelsFailed;
+      return;
+   }
+
+   std::vector<float> targets(channels.size(), 1.0f);
+   if (mute) {
+      levelKernels_.scale(
+         levels.data(), gains.data(), targets.data(), targets.size());
+   }
+   if (opts_.fadeMs != 0 && targets != levels) {
+      ScheduleChannelFade(
+         ev, ep, std::move(channels), std::move(levels), std::move(targets));
+      return;
+   }
+
+   PhaseSpan span(Phase::Volume, &ep);
+   ep.channelsChanged = 0;
+   ep.status = EndpointStatus::Unchanged;
+   for (size_t i = 0; i < channels.size(); ++i) {
+      if (targets[i] == levels[i]) {
+         continue;
+      }
+      ep.hr = ev->SetChannelVolumeLevelScalar(
+         channels[i], targets[i], &eventContext_);
+      if (FAILED(ep.hr)) {
+         ep.status = EndpointStatus::SetVolumeFailed;
+         return;
+      }
+      ++ep.channelsChanged;
+      ep.status = EndpointStatus::Changed;
+   }
+}
+
+/* Whether an endpoint or session in the given state should end up muted */
+static bool TargetMute(BOOL muted)
+{
+   switch (opts_.action) {
+   case Action::Unmute:
+      return false;
+   case Action::Toggle:
+      return !muted;
+   case Action::ToggleGroup:
+      return groupMuted_;
+   default:
+      return true;
+   }
+}
+
+static void MuteEndpoint(IAudioEndpointVolumePtr ev, Endpoint& ep)
+{
+   HRESULT hr;
+   {
+      PhaseSpan span(Phase::GetMute, &ep);
+      hr = ev->GetMute(&ep.wasMuted);
+   }
+   ep.hr = hr;
+   if (FAILED(hr)) {
+      ep.status = EndpointStatus::GetMuteFailed;
+      return;
+   }
+   ep.muted = ep.wasMuted;
+   if (!opts_.statePath.empty() || opts_.fadeMs != 0) {
+      PhaseSpan span(Phase::Volume, &ep);
+      if (FAILED(ev->GetMasterVolumeLevelScalar(&ep.volume))) {
+         ep.volume = -1.0f;
+      }
+   }
+   if (opts_.action == Action::Restore) {
+      RestoreEndpoint(ev, ep);
+      return;
+   }
+
+   if (!opts_.channels.empty() && opts_.action != Action::Status) {
+      ApplyChannels(ev, ep, opts_.action == Action::Mute);
+      return;
+   }
+
+   /* Toggling works off the state just read, no second round trip */
+   const bool mute = TargetMute(ep.wasMuted);
+   if (opts_.action == Action::Status || mute == !!ep.wasMuted) {
+      ep.status = EndpointStatus::Unchanged;
+      if (opts_.action != Action::Status && mute) {
+         RecordSilence();
+      }
+      return;
+   }
+   if (opts_.fadeMs != 0 && ep.volume > 0.0f) {
+      ScheduleFade(ev, ep, mute);
+      return;
+   }
+
+   {
+      PhaseSpan span(Phase::SetMute, &ep);
+      hr = ev->SetMute(mute, &eventContext_);
+   }
+   ep.hr = hr;
+   ep.status = FAILED(hr) ? EndpointStatus::SetMuteFailed
+                          : EndpointStatus::Changed;
+   if (SUCCEEDED(hr)) {
+      ep.muted = mute;
+      if (mute) {
+         RecordSilence();
+      }
+   }
+}
+
+static FilterResult FilterEndpoint(const Endpoint& ep, bool resolved)
+{
+   const wchar_t* values[] = {
+      resolved ? ep.name.c_str() : nullptr,
+      ep.id.empty() ? nullptr : ep.id.c_str(),
+      flowKeys_[ep.flow],
+      resolved ? ep.formFactor : nullptr
+   };
+   return filter_.Evaluate(values);
+}
+
+/* The steps below are kept in the endpoint, so that the daemon only pays for
+ * them once per device. Each returns false once the endpoint is finished. */
+
+/* Fills in what the enumeration left open about a device taken from the
+ * collection */
+static void AdoptItem(IMMDevicePtr device, Endpoint& ep)
+{
+   ep.handle.Reset(device);
+
+   /* Only a combined enumeration leaves the direction open */
+   IMMEndpointPtr endpoint;
+   EDataFlow flow = eRender;
+   if (opts_.flow == eAll
+       && SUCCEEDED(device.QueryInterface(__uuidof(IMMEndpoint), &endpoint))
+       && SUCCEEDED(endpoint->GetDataFlow(&flow))) {
+      ep.flow = flow;
+   }
+   if (opts_.stateMask != DEVICE_STATE_ACTIVE) {
+      device->GetState(&ep.state);
+   }
+}
+
+static bool ResolveDevice(IMMDeviceCollectionPtr audioEndpoints, Endpoint& ep)
+{
+   if (ep.status == EndpointStatus::NotFound || ep.trusted) {
+      return false;
+   }
+   if (!ep.handle.Device()) {
+      PhaseSpan span(Phase::Enumerate, &ep);
+      IMMDevicePtr device = nullptr;
+      ep.hr = audioEndpoints->Item(ep.index, &device);
+      if (FAILED(ep.hr)) {
+         ep.status = EndpointStatus::ItemFailed;
+         return false;
+      }
+      AdoptItem(device, ep);
+   }
+   if ((opts_.json || !defaultEndpointId_.empty() || !opts_.statePath.empty()
+        || !opts_.cachePath.empty() || !opts_.nameCachePath.empty()
+        || filter_.Needs(FilterField::Id))
+       && ep.id.empty()) {
+      LPWSTR id = nullptr;
+      if (SUCCEEDED(ep.handle.Device()->GetId(&id))) {
+         ep.id = id;
+         CoTaskMemFree(id);
+      }
+   }
+   if (!ep.id.empty() && ep.id == defaultEndpointId_) {
+      /* Already taken care of by MuteDefaultEndpoint() */
+      ep.status = EndpointStatus::Skipped;
+      return false;
+   }
+
+   /* Rules on the ID and direction can already rule it out here, so an
+    * excluded endpoint never opens its property store */
+   if (!filter_.Empty()
+       && FilterEndpoint(ep, false) == FilterResult::Excluded) {
+      ep.status = EndpointStatus::Filtered;
+      return false;
+   }
+   return true;
+}
+
+static void ReadFormFactor(IPropertyStorePtr propStore, Endpoint& ep)
+{
+   PROPVARIANT value;
+   PropVariantInit(&value);
+   UINT formFactor = UnknownFormFactor;
+   if (SUCCEEDED(propStore->GetValue(formFactorKey_, &value))
+       && value.vt == VT_UI4 && value.ulVal < EndpointFormFactor_enum_count) {
+      formFactor = value.ulVal;
+   }
+   PropVariantClear(&value);
+   ep.formFactor = formFactorKeys_[formFactor];
+}
+
+/* The name is only read when something is going to look at it. Daemon
+ * replies are captured even when the daemon itself is silent. */
+static bool NeedsName()
+{
+   return !opts_.silent || opts_.daemon || !opts_.cachePath.empty()
+      || filter_.Needs(FilterField::Name);
+}
+
+static bool ResolveName(Endpoint& ep)
+{
+   const bool readName = ep.name.empty() && NeedsName()
+      && !nameCache_.Find(ep.id, ep.name);
+   const bool readFormFactor = filter_.Needs(FilterField::FormFactor)
+      && ep.formFactor == nullptr;
+   if (readName || readFormFactor) {
+      PhaseSpan span(Phase::PropertyStore, &ep);
+      IPropertyStorePtr propStore;
+      HRESULT hr = ep.handle.PropertyStore(propStore);
+      if (FAILED(hr)) {
+         ep.hr = hr;
+         ep.status = EndpointStatus::PropertyStoreFailed;
+         return false;
+      }
+
+      if (readName) {
+         PROPVARIANT value;
+         PropVariantInit(&value);
+         hr = propStore->GetValue(PKEY_Device_FriendlyName, &value);
+         if (FAILED(hr)) {
+            ep.hr = hr;
+            ep.status = EndpointStatus::NameFailed;
+            return false;
+         }
+         ep.name = value.pwszVal;
+         PropVariantClear(&value);
+         nameCache_.Add(ep.id, ep.name);
+      }
+      if (readFormFactor) {
+         ReadFormFactor(propStore, ep);
+      }
+   }
+
+   if (!filter_.Empty() && FilterEndpoint(ep, true) != FilterResult::Included) {
+      ep.status = EndpointStatus::Filtered;
+      return false;
+   }
+   return true;
+}
+
+static bool ResolveEndpoint(IMMDeviceCollectionPtr audioEndpoints, Endpoint& ep)
+{
+   return ResolveDevice(audioEndpoints, ep) && ResolveName(ep);
+}
+
+static bool ActivateVolume(
+   Endpoint& ep,
+   IAudioEndpointVolumePtr& endpointVolume)
+{
+   PhaseSpan span(Phase::Activate, &ep);
+   ep.hr = ep.handle.Volume(endpointVolume);
+   if (FAILED(ep.hr)) {
+      ep.status = EndpointStatus::EndpointVolumeFailed;
+      return false;
+   }
+   return true;
+}
+
+static bool ActivateSessions(
+   Endpoint& ep,
+   IAudioSessionManager2Ptr& sessionManager)
+{
+   PhaseSpan span(Phase::Activate, &ep);
+   ep.hr = ep.handle.SessionManager(sessionManager);
+   if (FAILED(ep.hr)) {
+      ep.status = EndpointStatus::SessionsFailed;
+      return false;
+   }
+   return true;
+}
+
+/* Applies the action to the sessions of the -app targets only. The endpoint
+ * counts as muted if all of these sessions are. */
+static void MuteSessions(Endpoint& ep)
+{
+   IAudioSessionManager2Ptr sessionManager;
+   if (!ActivateSessions(ep, sessionManager)) {
+      return;
+   }
+
+   SessionTable table;
+   {
+      PhaseSpan span(Phase::Sessions, &ep);
+      ep.hr = table.Load(sessionManager);
+   }
+   if (FAILED(ep.hr)) {
+      ep.status = EndpointStatus::SessionsFailed;
+      return;
+   }
+
+   const std::vector<ISimpleAudioVolumePtr> sessions = table.Match(opts_.apps);
+   EndpointStatus failure = EndpointStatus::Pending;
+   UINT nowMuted = 0;
+   ep.sessions = static_cast<UINT>(sessions.size());
+   ep.sessionsMuted = 0;
+   ep.sessionsChanged = 0;
+   for (const ISimpleAudioVolumePtr& volume : sessions) {
+      BOOL muted = FALSE;
+      HRESULT hr;
+      {
+         PhaseSpan span(Phase::GetMute, &ep);
+         hr = volume->GetMute(&muted);
+      }
+      if (FAILED(hr)) {
+         ep.hr = hr;
+         failure = EndpointStatus::GetMuteFailed;
+         continue;
+      }
+      ep.sessionsMuted += (muted != FALSE);
+      const bool mute = TargetMute(muted);
+      if (opts_.action == Action::Status || mute == !!muted) {
+         nowMuted += (muted != FALSE);
+         continue;
+      }
+      {
+         PhaseSpan span(Phase::SetMute, &ep);
+         hr = volume->SetMute(mute, &eventContext_);
+      }
+      if (FAILED(hr)) {
+         ep.hr = hr;
+         failure = EndpointStatus::SetMuteFailed;
+         nowMuted += (muted != FALSE);
+      } else {
+         ++ep.sessionsChanged;
+         nowMuted += mute;
+      }
+   }
+
+   ep.wasMuted = (ep.sessionsMuted == ep.sessions);
+   ep.muted = (nowMuted == ep.sessions);
+   if (ep.sessions == 0) {
+      ep.status = EndpointStatus::NoSessions;
+   } else if (failure != EndpointStatus::Pending) {
+      ep.status = failure;
+   } else {
+      ep.status = (ep.sessionsChanged != 0) ? EndpointStatus::Changed
+                                            : EndpointStatus::Unchanged;
+   }
+}
+
+static void MuteResolvedEndpoint(Endpoint& ep)
+{
+   if (!opts_.apps.empty()) {
+      MuteSessions(ep);
+      return;
+   }
+
+   if (opts_.action == Action::Restore
+       && (ep.saved = FindSavedState(ep.id)) == nullptr) {
+      /* Not part of the snapshot, left alone */
+      ep.status = EndpointStatus::NotSaved;
+      return;
+   }
+
+   IAudioEndpointVolumePtr endpointVolume;
+   if (!ActivateVolume(ep, endpointVolume)) {
+      return;
+   }
+   MuteEndpoint(endpointVolume, ep);
+   if (ep.status == EndpointStatus::GetMuteFailed
+       || ep.status == EndpointStatus::SetMuteFailed) {
+      /* Most likely invalidated, activate again next time */
+      ep.handle.Invalidate();
+   }
+}
+
+static void ApplyToEndpoint(
+   IMMDeviceCollectionPtr audioEndpoints,
+   Endpoint& ep)
+{
+   if (ResolveEndpoint(audioEndpoints, ep)) {
+      MuteResolvedEndpoint(ep);
+   }
+}
+
+static void ProcessEndpoint(IMMDeviceCollectionPtr audioEndpoints, Endpoint& ep)
+{
+   const LONGLONG start = (measure_ || opts_.json) ? Now() : 0;
+   ApplyToEndpoint(audioEndpoints, ep);
+   if (start != 0) {
+      ep.ticks += Now() - start;
+   }
+}
+
+static const wchar_t* MuteStateName(BOOL muted)
+{
+   return muted ? L"\"muted\"" : L"\"unmuted\"";
+}
+
+/* Writes one JSON line per endpoint and flushes it right away, so consumers
+ * see every endpoint as soon as it is done. */
+static void ReportEndpointJson(const Endpoint& ep)
+{
+   output_.Append([&ep](std::wstring& out) {
+      JsonRecord record(out);
+      record.String(L"id", ep.id.c_str());
+      record.String(L"name", ep.name.c_str());
+      record.String(L"flow", flowKeys_[ep.flow]);
+      for (size_t i = 0; i < std::size(reportedStates_); ++i) {
+         if (opts_.stateMask != DEVICE_STATE_ACTIVE
+             && ep.state == reportedStates_[i]) {
+            record.String(L"device_state", reportedStateKeys_[i]);
+         }
+      }
+      const bool known = ep.status >= EndpointStatus::SetMuteFailed;
+      record.Literal(L"previous", known ? MuteStateName(ep.wasMuted) : L"null");
+      record.Literal(L"state", known ? MuteStateName(ep.muted) : L"null");
+      record.String(L"status", statusKeys_[static_cast<int>(ep.status)]);
+      if (!opts_.apps.empty()) {
+         record.Number(L"sessions", ep.sessions);
+         record.Number(L"sessions_changed", ep.sessionsChanged);
+      }
+      if (!opts_.channels.empty()) {
+         record.Number(L"channels_changed", ep.channelsChanged);
+      }
+      if (ep.status == EndpointStatus::TimedOut) {
+         record.Literal(L"started", ep.queued ? L"false" : L"true");
+         if (ep.hungIn < Phase::Count) {
+            record.String(L"call", phaseKeys_[static_cast<int>(ep.hungIn)]);
+         }
+      }
+      wchar_t hr[16];
+      swprintf(hr, 16, L"0x%08lx", static_cast<unsigned long>(ep.hr));
+      record.String(L"hr", hr);
+      record.Number(L"us", TicksToUs(ep.ticks));
+   });
+   output_.Flush();
+}
+
+/* Tells for -include-inactive which device states took the write. Drivers
+ * that keep the state of inactive endpoints bring them back muted. */
+static void ReportStates(const std::vector<Endpoint>& endpoints)
+{
+   for (size_t i = 0; i < std::size(reportedStates_); ++i) {
+      LONGLONG total = 0;
+      LONGLONG accepted = 0;
+      LONGLONG unchanged = 0;   /* made no write at all */
+      for (const Endpoint& ep : endpoints) {
+         if (ep.state != reportedStates_[i]
+             || ep.status >= EndpointStatus::Skipped) {
+            continue;
+         }
+         ++total;
+         accepted += (ep.status == EndpointStatus::Changed);
+         unchanged += (ep.status == EndpointStatus::Unchanged);
+      }
+      if (total == 0) {
+         continue;
+      }
+      if (opts_.json) {
+         if (!opts_.silent) {
+            output_.Append([&](std::wstring& out) {
+               JsonRecord record(out);
+               record.String(L"device_state", reportedStateKeys_[i]);
+               record.Number(L"endpoints", total);
+               record.Number(L"accepted", accepted);
+               record.Number(L"unchanged", unchanged);
+            });
+         }
+      } else {
+         Print(
+            L"%lld of %lld %ls endpoints accepted the write, %lld already "
+            L"were in the state",
+            accepted, total, reportedStateKeys_[i], unchanged);
+      }
+   }
+}
+
+static void ReportSummaryJson(
+   const std::vector<Endpoint>& endpoints,
+   LONGLONG ticks)
+{
+   LONGLONG total = 0;
+   LONGLONG changed = 0;
+   LONGLONG unchanged = 0;
+   for (const Endpoint& ep : endpoints) {
+      total += (ep.status < EndpointStatus::Skipped);
+      changed += (ep.status == EndpointStatus::Changed);
+      unchanged += (ep.status == EndpointStatus::Unchanged);
+   }
+   output_.Append([&](std::wstring& out) {
+      JsonRecord record(out);
+      record.Literal(L"summary", L"true");
+      record.Number(L"endpoints", total);
+      record.Number(L"changed", changed);
+      record.Number(L"unchanged", unchanged);
+      record.Number(L"failed", total - changed - unchanged);
+      record.Number(L"us", TicksToUs(ticks));
+      if (firstSilenceTicks_ != 0) {
+         record.Number(L"first_silence_us", TicksToUs(firstSilenceTicks_));
+      }
+   });
+   output_.Flush();
+}
+
+static void ReportSessions(const Endpoint& ep)
+{
+   const wchar_t* deviceName = ep.name.c_str();
+   switch (ep.status) {
+   case EndpointStatus::SessionsFailed:
+      PrintError(
+         L"Failed to enumerate audio sessions for device \"%ls\"",
+         deviceName);
+      return;
+   case EndpointStatus::GetMuteFailed:
+      PrintError(
+         L"Failed to get mute status of a session on device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::SetMuteFailed:
+      PrintError(
+         L"Failed to set mute status of a session on device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::Unchanged:
+      if (opts_.action == Action::Status) {
+         Print(
+            L"> %u of %u sessions on %ls are muted",
+            ep.sessionsMuted, ep.sessions, deviceName);
+      } else {
+         Print(
+            L"> All %u sessions on %ls are already %lsmuted.",
+            ep.sessions, deviceName,
+            (ep.wasMuted) ? L"" : L"un");
+      }
+      break;
+   case EndpointStatus::Changed:
+      Print(
+         L"> %u of %u sessions on %ls are now %lsmuted",
+         ep.sessionsChanged, ep.sessions, deviceName,
+         (ep.muted) ? L"" : L"un");
+      break;
+   default:
+      break;
+   }
+   Print(L"");
+}
+
+static void ReportChannels(const Endpoint& ep)
+{
+   const wchar_t* deviceName = ep.name.c_str();
+   const wchar_t* change = (opts_.action == Action::Unmute)
+      ? L"restored" : L"muted";
+   switch (ep.status) {
+   case EndpointStatus::ChannelsFailed:
+      PrintError(
+         L"Failed to get channel levels for device \"%ls\"",
+         deviceName);
+      return;
+   case EndpointStatus::GetMuteFailed:
+      PrintError(
+         L"Failed to get mute status for device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::SetVolumeFailed:
+      PrintError(
+         L"Failed to set channel levels for device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::Unchanged:
+      Print(L"> The channels of %ls are already %ls.", deviceName, change);
+      break;
+   case EndpointStatus::Changed:
+      Print(
+         L"> %u channels of %ls are now %ls",
+         ep.channelsChanged, deviceName, change);
+      break;
+   default:
+      break;
+   }
+   Print(L"");
+}
+
+static void ReportTimedOut(const Endpoint& ep)
+{
+   if (ep.queued) {
+      PrintError(
+         L"Timed out before audio endpoint #%u was started, raise -jobs "
+         L"or -timeout",
+         ep.index);
+      return;
+   }
+   const wchar_t* call = (ep.hungIn < Phase::Count)
+      ? phaseNames_[static_cast<int>(ep.hungIn)] : L"a driver call";
+   if (ep.name.empty()) {
+      PrintError(L"Timed out in %ls on audio endpoint #%u", call, ep.index);
+   } else {
+      PrintError(
+         L"Timed out in %ls on device \"%ls\"", call, ep.name.c_str());
+   }
+}
+
+static void ReportEndpoint(const Endpoint& ep)
+{
+   if (ep.status >= EndpointStatus::Skipped) {
+      return;
+   }
+   if (opts_.json && capture_ == nullptr) {
+      if (!opts_.silent) {
+         ReportEndpointJson(ep);
+      }
+      return;
+   }
+
+   switch (ep.status) {
+   case EndpointStatus::ItemFailed:
+      PrintError(L"Failed to get audio endpoint #%u", ep.index);
+      return;
+   case EndpointStatus::NotFound:
+      PrintError(L"No audio endpoint with ID \"%ls\"", ep.id.c_str());
+      return;
+   case EndpointStatus::PropertyStoreFailed:
+      PrintError(
+         L"Failed to open property store for audio endpoint #%u",
+         ep.index);
+      return;
+   case EndpointStatus::NameFailed:
+      PrintError(L"Failed to get device name for audio endpoint #%u", ep.index);
+      return;
+   case EndpointStatus::TimedOut:
+      ReportTimedOut(ep);
+      return;
+   default:
+      break;
+   }
+
+   const wchar_t* deviceName = ep.name.c_str();
+   Print(
+      L"Found audio endpoint \"%ls\"%ls%ls",
+      deviceName,
+      (ep.flow == eCapture) ? L" (capture)" : L"",
+      (ep.state == DEVICE_STATE_DISABLED) ? L" (disabled)"
+         : (ep.state == DEVICE_STATE_UNPLUGGED) ? L" (unplugged)" : L"");
+   if (!opts_.apps.empty()) {
+      ReportSessions(ep);
+      return;
+   }
+   if (!opts_.channels.empty() && opts_.action != Action::Status
+       && ep.status != EndpointStatus::EndpointVolumeFailed) {
+      ReportChannels(ep);
+      return;
+   }
+
+   switch (ep.status) {
+   case EndpointStatus::EndpointVolumeFailed:
+      PrintError(
+         L"Failed to active endpoint volume for device \"%ls\"",
+         deviceName);
+      return;
+   case EndpointStatus::GetMuteFailed:
+      PrintError(
+         L"Failed to get mute status for device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::SetVolumeFailed:
+      PrintError(
+         L"Failed to %ls volume for device \"%ls\"",
+         (opts_.action == Action::Restore) ? L"restore" : L"set",
+         deviceName);
+      break;
+   case EndpointStatus::Unchanged:
+      if (opts_.action == Action::Status) {
+         Print(
+            L"> %ls is %lsmuted",
+            deviceName,
+            (ep.wasMuted) ? L"" : L"un");
+      } else if (opts_.action == Action::Restore) {
+         Print(L"> %ls is already as saved.", deviceName);
+      } else {
+         Print(
+            L"> %ls is already %lsmuted.",
+            deviceName,
+            (ep.wasMuted) ? L"" : L"un");
+      }
+      break;
+   case EndpointStatus::SetMuteFailed:
+      PrintError(
+         L"Failed to set mute status for device \"%ls\"",
+         deviceName);
+      break;
+   case EndpointStatus::Changed:
+      if (opts_.action == Action::Restore) {
+         Print(
+            L"> %ls is restored, %lsmuted at %.0f%%",
+            deviceName,
+            (ep.muted) ? L"" : L"un",
+            std::max(ep.volume, 0.0f) * 100.0);
+         break;
+      }
+      Print(
+         L"> %ls is now %lsmuted",
+         deviceName,
+         (ep.muted) ? L"" : L"un");
+      break;
+   default:
+      break;
+   }
+   Print(L"");
+}
+
+/* Emits the reports in enumeration order, each one as soon as the endpoint
+ * and all of its predecessors are done. */
+static void ReportInOrder(
+   std::span<Endpoint> endpoints,
+   std::mutex& lock,
+   std::condition_variable& doneCond)
+{
+   for (const Endpoint& ep : endpoints) {
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         doneCond.wait(guard, [&ep] { return ep.done; });
+      }
+      ReportEndpoint(ep);
+   }
+}
+
+/* Runs body on a new thread that has joined the MTA */
+template <typename Body>
+static std::thread StartWorker(Body body)
+{
+   return std::thread([body] {
+      StartTraceThread();
+      const HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+      body();
+      if (SUCCEEDED(hr)) {
+         CoUninitialize();
+      }
+   });
+}
+
+/* Runs the steps of all endpoints as a pipeline with one thread per stage.
+ * Slow driver calls of one endpoint overlap with the other stages working
+ * on its neighbours, without needing a thread per endpoint. */
+static void RunPipeline(
+   IMMDeviceCollectionPtr audioEndpoints,
+   std::span<Endpoint> endpoints)
+{
+   const size_t depth = 8;
+   BoundedQueue<Endpoint*> toName(depth);
+   BoundedQueue<Endpoint*> toActivate(depth);
+   BoundedQueue<Endpoint*> toMute(depth);
+   std::vector<LONGLONG> started(endpoints.size(), 0);
+   std::mutex lock;
+   std::condition_variable doneCond;
+
+   auto finish = [&](Endpoint& ep) {
+      const LONGLONG start = started[&ep - endpoints.data()];
+      if (start != 0) {
+         ep.ticks += Now() - start;
+      }
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         ep.done = true;
+      }
+      doneCond.notify_all();
+   };
+
+   std::thread stages[] = {
+      StartWorker([&] {
+         const bool timed = measure_ || opts_.json;
+         for (Endpoint& ep : endpoints) {
+            started[&ep - endpoints.data()] = timed ? Now() : 0;
+            if (ResolveDevice(audioEndpoints, ep)) {
+               toName.Push(&ep);
+            } else {
+               finish(ep);
+            }
+         }
+         toName.Close();
+      }),
+      StartWorker([&] {
+         for (Endpoint* ep = nullptr; toName.Pop(ep); ) {
+            if (ResolveName(*ep)) {
+               toActivate.Push(ep);
+            } else {
+               finish(*ep);
+            }
+         }
+         toActivate.Close();
+      }),
+      StartWorker([&] {
+         for (Endpoint* ep = nullptr; toActivate.Pop(ep); ) {
+            IAudioEndpointVolumePtr endpointVolume;
+            IAudioSessionManager2Ptr sessionManager;
+            if (opts_.apps.empty() ? ActivateVolume(*ep, endpointVolume)
+                                   : ActivateSessions(*ep, sessionManager)) {
+               toMute.Push(ep);
+            } else {
+               finish(*ep);
+            }
+         }
+         toMute.Close();
+      }),
+      StartWorker([&] {
+         for (Endpoint* ep = nullptr; toMute.Pop(ep); ) {
+            MuteResolvedEndpoint(*ep);
+            finish(*ep);
+         }
+      })
+   };
+
+   ReportInOrder(endpoints, lock, doneCond);
+   for (std::thread& stage : stages) {
+      stage.join();
+   }
+
+   const BoundedQueue<Endpoint*>* inputs[] = {
+      nullptr, &toName, &toActivate, &toMute
+   };
+   const BoundedQueue<Endpoint*>* outputs[] = {
+      &toName, &toActivate, &toMute, nullptr
+   };
+   for (int stage = 0; stage < pipelineStageCount_; ++stage) {
+      PipelineStats& stats = pipelineStats_[stage];
+      if (inputs[stage] != nullptr) {
+         stats.maxDepth = std::max(stats.maxDepth, inputs[stage]->MaxDepth());
+         stats.inputStall += inputs[stage]->PopStall();
+      }
+      if (outputs[stage] != nullptr) {
+         stats.outputStall += outputs[stage]->PushStall();
+      }
+   }
+}
+
+/* Keeps the phase times of an endpoint for the -timings report */
+static void RecordEndpointTimes(const Endpoint& ep)
+{
+   wchar_t fallback[32];
+   swprintf(fallback, 32, L"#%u", ep.index);
+   endpointTimes_.push_back({
+      ep.name.empty() ? fallback : ep.name, ep.times, ep.ticks });
+}
+
+/* Waits for the scheduled fades and reports their endpoints, which were left
+ * out while they were fading */
+static void FinishFades()
+{
+   for (const Endpoint* ep : RunFades()) {
+      ReportEndpoint(*ep);
+   }
+}
+
+/* Leaves right away, since threads stuck in a driver call can neither be
+ * stopped nor waited for. Only the output is written out. */
+[[noreturn]] static void ExitTimedOut()
+{
+   PrintError(L"Timed out after %.0f ms", TicksToMs(Now() - startTicks_));
+   FlushOutput();
+   TerminateProcess(GetCurrentProcess(), exitTimedOut_);
+   ExitProcess(exitTimedOut_);
+}
+
+/* Catches a hang anywhere else, enumeration and fades included, a little
+ * after the endpoints had a chance to report theirs. */
+static void StartWatchdog()
+{
+   runDone_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+   if (runDone_ == nullptr) {
+      return;
+   }
+   std::thread([] {
+      if (WaitForSingleObject(runDone_, opts_.timeoutMs + watchdogGraceMs_)
+          == WAIT_TIMEOUT) {
+         std::lock_guard<std::mutex> guard(timeoutLock_);
+         if (WaitForSingleObject(runDone_, 0) == WAIT_TIMEOUT) {
+            ExitTimedOut();
+         }
+      }
+   }).detach();
+}
+
+static void StopWatchdog()
+{
+   if (runDone_ != nullptr) {
+      std::lock_guard<std::mutex> guard(timeoutLock_);
+      SetEvent(runDone_);
+   }
+}
+
+static void MoveFades(const Endpoint* from, Endpoint* to)
+{
+   std::lock_guard<std::mutex> guard(fadeLock_);
+   for (Fade& fade : fades_) {
+      if (fade.ep == from) {
+         fade.ep = to;
+      }
+   }
+}
+
+/* Gives every fade the end state of its ramp right away, for when there is
+ * no time left to run them. Only fades of the given endpoints are touched,
+ * the others may belong to an endpoint that is still stuck. */
+static void SettleFades(std::span<Endpoint> endpoints)
+{
+   std::vector<Fade> fades;
+   {
+      std::lock_guard<std::mutex> guard(fadeLock_);
+      fades.swap(fades_);
+   }
+   for (Fade& fade : fades) {
+      if (fade.ep < endpoints.data()
+          || fade.ep >= endpoints.data() + endpoints.size()) {
+         continue;
+      }
+      if (!fade.channels.empty()) {
+         SetFadeChannels(fade, fade.to.data());
+         if (fade.ep->status == EndpointStatus::Fading) {
+            fade.ep->status = EndpointStatus::Changed;
+            fade.ep->channelsChanged = static_cast<UINT>(fade.channels.size());
+         }
+      } else if (SUCCEEDED(SetFadeMute(fade))) {
+         fade.ep->status = EndpointStatus::Changed;
+         fade.ep->muted = fade.mute;
+         if (fade.mute) {
+            RecordSilence();
+         }
+      }
+      ReportEndpoint(*fade.ep);
+   }
+}
+
+/* With -timeout the endpoints run on up to -jobs threads. An endpoint that
+ * is not done within -endpoint-timeout is abandoned together with its
+ * thread, and a new thread takes over the rest of the queue. Each endpoint
+ * is worked on as a copy that is only taken back once it is done, so
+ * nothing is shared with an abandoned one. Either all threads are joined
+ * or the process exits, after the endpoints that are done got their fades
+ * settled. */
+static void RunEndpointsUntil(
+   IMMDeviceCollectionPtr audioEndpoints,
+   std::span<Endpoint> endpoints)
+{
+   using Clock = std::chrono::steady_clock;
+   struct Task {
+      Endpoint ep;
+      std::atomic<Phase> call = Phase::Count;
+      bool started = false;
+      Clock::time_point startedAt;
+      size_t worker = 0;
+      bool done = false;
+      bool abandoned = false;
+   };
+   std::mutex lock;
+   std::condition_variable doneCond;
+   std::vector<Task> tasks(endpoints.size());
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      Task& task = tasks[i];
+      Endpoint& ep = endpoints[i];
+      task.ep = std::move(ep);
+      ep.index = task.ep.index;
+      ep.id = task.ep.id;
+      ep.flow = task.ep.flow;
+      ep.state = task.ep.state;
+      ep.name = task.ep.name;
+   }
+
+   /* Guarded by lock, like the tasks */
+   size_t next = 0;
+   std::deque<bool> retired;
+   std::vector<std::thread> workers;
+   auto startWorker = [&] {
+      const size_t w = workers.size();
+      retired.push_back(false);
+      workers.push_back(StartWorker([&, w, audioEndpoints] {
+         for (;;) {
+            Task* task = nullptr;
+            {
+               std::lock_guard<std::mutex> guard(lock);
+               if (retired[w] || next == tasks.size()
+                   || Clock::now() >= deadline_) {
+                  return;
+               }
+               task = &tasks[next++];
+               task->started = true;
+               task->startedAt = Clock::now();
+               task->worker = w;
+            }
+            currentCall_ = &task->call;
+            ProcessEndpoint(audioEndpoints, task->ep);
+            currentCall_ = nullptr;
+            {
+               std::lock_guard<std::mutex> guard(lock);
+               task->done = true;
+            }
+            doneCond.notify_all();
+         }
+      }));
+   };
+
+   const auto budget = std::chrono::milliseconds(opts_.endpointTimeoutMs);
+   size_t reported = 0;
+   bool abandoned = false;
+   std::unique_lock<std::mutex> guard(lock);
+   for (size_t w = 0; w < std::min<size_t>(opts_.jobs, tasks.size()); ++w) {
+      startWorker();
+   }
+   while (reported < tasks.size()) {
+      const Clock::time_point now = Clock::now();
+      Clock::time_point wake = deadline_;
+      for (Task& task : tasks) {
+         if (!task.started || task.done || task.abandoned) {
+            continue;
+         }
+         if (now < task.startedAt + budget) {
+            wake = std::min(wake, task.startedAt + budget);
+            continue;
+         }
+         task.abandoned = true;
+         abandoned = true;
+         retired[task.worker] = true;
+         if (next < tasks.size()) {
+            startWorker();
+         }
+      }
+      for (; reported < tasks.size(); ++reported) {
+         Task& task = tasks[reported];
+         Endpoint& ep = endpoints[reported];
+         if (task.done && !task.abandoned) {
+            ep = std::move(task.ep);
+            MoveFades(&task.ep, &ep);
+         } else if (task.abandoned) {
+            ep.status = EndpointStatus::TimedOut;
+            ep.hungIn = task.call;
+         } else {
+            break;
+         }
+         ReportEndpoint(ep);
+      }
+      if (reported == tasks.size() || now >= deadline_) {
+         break;
+      }
+      doneCond.wait_until(guard, wake);
+   }
+
+   if (reported == tasks.size() && !abandoned) {
+      guard.unlock();
+      for (std::thread& worker : workers) {
+         worker.join();
+      }
+      return;
+   }
+
+   /* What is still running or queued at the deadline times out as well */
+   std::unique_lock<std::mutex> exitGuard(timeoutLock_);
+   for (; reported < tasks.size(); ++reported) {
+      Task& task = tasks[reported];
+      Endpoint& ep = endpoints[reported];
+      ep.status = EndpointStatus::TimedOut;
+      ep.hungIn = task.call;
+      ep.queued = !task.started;
+      ReportEndpoint(ep);
+   }
+   guard.unlock();
+   SettleFades(endpoints);
+   ExitTimedOut();
+}
+
+/* Processes all endpoints, either inline, as a pipeline or on a pool of MTA
+ * worker threads. */
+static void RunEndpoints(
+   IMMDeviceCollectionPtr audioEndpoints,
+   std::span<Endpoint> endpoints)
+{
+   if (opts_.timeoutMs != 0) {
+      RunEndpointsUntil(audioEndpoints, endpoints);
+      return;
+   }
+   if (opts_.pipeline && endpoints.size() > 1) {
+      RunPipeline(audioEndpoints, endpoints);
+      return;
+   }
+
+   const size_t jobs = std::min<size_t>(opts_.jobs, endpoints.size());
+   if (jobs <= 1) {
+      for (Endpoint& ep : endpoints) {
+         ProcessEndpoint(audioEndpoints, ep);
+         ReportEndpoint(ep);
+      }
+      return;
+   }
+
+   std::mutex lock;
+   std::condition_variable doneCond;
+   std::atomic<size_t> next = 0;
+   std::vector<std::thread> workers;
+   workers.reserve(jobs);
+   for (size_t w = 0; w < jobs; ++w) {
+      workers.push_back(StartWorker([&] {
+         for (size_t i = next++; i < endpoints.size(); i = next++) {
+            ProcessEndpoint(audioEndpoints, endpoints[i]);
+            {
+               std::lock_guard<std::mutex> guard(lock);
+               endpoints[i].done = true;
+            }
+            doneCond.notify_all();
+         }
+      }));
+   }
+
+   ReportInOrder(endpoints, lock, doneCond);
+   for (std::thread& worker : workers) {
+      worker.join();
+   }
+}
+
+static HRESULT CreateSystemEnumerator(IMMDeviceEnumeratorPtr& deviceEnumerator)
+{
+   return deviceEnumerator.CreateInstance(
+      __uuidof(MMDeviceEnumerator),
+      nullptr,
+      CLSCTX_INPROC_SERVER);
+}
+
+/* Every endpoint is reached through the enumerator made here, so replacing
+ * it puts the whole tool on another backend. The tests use a fake one. */
+static HRESULT (*createEnumerator_)(IMMDeviceEnumeratorPtr&) =
+   CreateSystemEnumerator;
+
+static bool CreateDeviceEnumerator(IMMDeviceEnumeratorPtr& deviceEnumerator)
+{
+   PhaseSpan span(Phase::CreateEnumerator);
+   if (FAILED(createEnumerator_(deviceEnumerator))) {
+      PrintError(L"Failed to create instance of MMDeviceEnumerator");
+      return false;
+   }
+   return true;
+}
+
+static bool EnumerateEndpoints(
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   IMMDeviceCollectionPtr& audioEndpoints,
+   std::vector<Endpoint>& endpoints)
+{
+   PhaseSpan span(Phase::Enumerate);
+   HRESULT hr = deviceEnumerator->EnumAudioEndpoints(
+      opts_.flow,
+      opts_.stateMask,
+      &audioEndpoints);
+   if (FAILED(hr)) {
+      PrintError(L"Failed to enumerate all audio endpoints");
+      return false;
+   }
+
+   UINT epCount;
+   hr = audioEndpoints->GetCount(&epCount);
+   if (FAILED(hr)) {
+      PrintError(L"Failed to get endpoint count");
+      return false;
+   }
+
+   endpoints.clear();
+   endpoints.resize(epCount);
+   for (UINT i = 0; i < epCount; ++i) {
+      endpoints[i].index = i;
+      endpoints[i].flow = (opts_.flow == eAll) ? eRender : opts_.flow;
+   }
+   return true;
+}
+
+/* Resolves the default endpoint directly and deals with it before the
+ * endpoints are even enumerated, so the device that is actually being heard
+ * goes quiet first. The caller reports it once its index is known. Returns
+ * false if there is no default endpoint. */
+static bool MuteDefaultEndpoint(
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   Endpoint& ep)
+{
+   const EDataFlow flow = (opts_.flow == eAll) ? eRender : opts_.flow;
+   IMMDevicePtr device;
+   LPWSTR id = nullptr;
+   if (FAILED(deviceEnumerator->GetDefaultAudioEndpoint(
+         flow, eConsole, &device))
+       || FAILED(device->GetId(&id))) {
+      return false;
+   }
+   ep.id = id;
+   ep.flow = flow;
+   ep.handle.Reset(device);
+   CoTaskMemFree(id);
+
+   ProcessEndpoint(nullptr, ep);
+   ep.done = true;
+   defaultEndpointId_ = ep.id;
+   return true;
+}
+
+/* For -toggle-group, every endpoint follows the default endpoint, which
+ * decides the group's new state. Returns false if there is none. */
+static bool ResolveGroupState(IMMDeviceEnumeratorPtr deviceEnumerator)
+{
+   const EDataFlow flow = (opts_.flow == eAll) ? eRender : opts_.flow;
+   IMMDevicePtr device;
+   IAudioEndpointVolumePtr endpointVolume;
+   BOOL muted = FALSE;
+   {
+      PhaseSpan span(Phase::GetMute);
+      if (FAILED(deviceEnumerator->GetDefaultAudioEndpoint(
+            flow, eConsole, &device))
+          || FAILED(device->Activate(
+               __uuidof(IAudioEndpointVolume), CLSCTX_INPROC_SERVER,
+               nullptr, reinterpret_cast<LPVOID*>(&endpointVolume)))
+          || FAILED(endpointVolume->GetMute(&muted))) {
+         PrintError(L"Failed to get mute status of the default endpoint");
+         return false;
+      }
+   }
+   groupMuted_ = !muted;
+   return true;
+}
+
+/* Resolves every endpoint given with -id directly by its ID. The cost only
+ * depends on the number of targets, not on the number of devices. */
+static void LookupEndpoints(
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   std::vector<Endpoint>& endpoints)
+{
+   endpoints.resize(opts_.ids.size());
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      Endpoint& ep = endpoints[i];
+      ep.index = static_cast<UINT>(i);
+      ep.id = opts_.ids[i];
+
+      PhaseSpan span(Phase::Enumerate, &ep);
+      IMMDevicePtr device;
+      ep.hr = deviceEnumerator->GetDevice(ep.id.c_str(), &device);
+      if (FAILED(ep.hr)) {
+         ep.status = EndpointStatus::NotFound;
+         continue;
+      }
+      ep.handle.Reset(device);
+
+      IMMEndpointPtr endpoint;
+      EDataFlow flow = eRender;
+      if (SUCCEEDED(device.QueryInterface(__uuidof(IMMEndpoint), &endpoint))
+          && SUCCEEDED(endpoint->GetDataFlow(&flow))) {
+         ep.flow = flow;
+      }
+      device->GetState(&ep.state);
+   }
+}
+
+/* Only the device and its ID, which the cache needs before any endpoint is
+ * processed. Neither is a driver call, the rest is left to ResolveDevice(),
+ * which goes on with the device kept here. */
+static void ResolveId(IMMDeviceCollectionPtr audioEndpoints, Endpoint& ep)
+{
+   if (!ep.id.empty() || audioEndpoints == nullptr) {
+      return;
+   }
+   PhaseSpan span(Phase::Enumerate, &ep);
+   IMMDevicePtr device = ep.handle.Device();
+   if (!device) {
+      if (FAILED(audioEndpoints->Item(ep.index, &device))) {
+         return;
+      }
+      AdoptItem(device, ep);
+   }
+   LPWSTR id = nullptr;
+   if (SUCCEEDED(device->GetId(&id))) {
+      ep.id = id;
+      CoTaskMemFree(id);
+   }
+}
+
+/* Gets the IDs up front and, if the endpoints are still the ones the cache
+ * was written for, hands out the cached names. With -trust-cache an
+ * endpoint the cache says is in the requested state is not touched at all,
+ * everything else is confirmed by the usual mute state read. */
+static void ApplyCache(
+   IMMDeviceCollectionPtr audioEndpoints,
+   std::span<Endpoint> endpoints,
+   DeviceCache& cache)
+{
+   for (Endpoint& ep : endpoints) {
+      ResolveId(audioEndpoints, ep);
+   }
+   LoadCache(cache);
+   const ULONGLONG fingerprint = FingerprintEndpoints(endpoints);
+   cache.matched = !cache.entries.empty() && cache.fingerprint == fingerprint;
+   cache.fingerprint = fingerprint;
+   if (!cache.matched) {
+      return;
+   }
+
+   /* The device state of a skipped endpoint would stay unknown */
+   const bool trust = opts_.trustCache && opts_.action <= Action::Unmute
+      && opts_.stateMask == DEVICE_STATE_ACTIVE;
+   const DWORD target = (opts_.action == Action::Mute) ? 1 : 0;
+   for (Endpoint& ep : endpoints) {
+      if (ep.status != EndpointStatus::Pending || ep.id.empty()
+          || (ep.cached = FindCacheEntry(cache, ep.id)) == nullptr) {
+         continue;
+      }
+      if (!filter_.Needs(FilterField::FormFactor)) {
+         ep.name.assign(
+            cache.names, ep.cached->nameOffset, ep.cached->nameLength);
+      }
+      if (!trust || ep.cached->muted != target || ep.name.empty()
+          || ep.cached->flow >= eAll || ep.id == defaultEndpointId_) {
+         continue;
+      }
+      ep.flow = static_cast<EDataFlow>(ep.cached->flow);
+      if (filter_.Empty()
+          || FilterEndpoint(ep, true) == FilterResult::Included) {
+         ep.trusted = true;
+         ep.wasMuted = ep.muted = target;
+         ep.status = EndpointStatus::Unchanged;
+      }
+   }
+}
+
+/* A hit is an endpoint found in the requested state just like the cache
+ * said, the time saved is what the skipped steps took when last done. */
+static void ReportCache(
+   std::span<const Endpoint> endpoints,
+   const DeviceCache& cache)
+{
+   LONGLONG total = 0;
+   LONGLONG hits = 0;
+   LONGLONG savedUs = 0;
+   for (const Endpoint& ep : endpoints) {
+      total += (ep.status < EndpointStatus::Skipped);
+      const CacheEntry* entry = ep.cached;
+      if (entry == nullptr || ep.status != EndpointStatus::Unchanged
+          || ep.wasMuted != static_cast<BOOL>(entry->muted)) {
+         continue;
+      }
+      ++hits;
+      if (ep.times.calls[static_cast<int>(Phase::PropertyStore)] == 0) {
+         savedUs += entry->nameUs;
+      }
+      if (ep.trusted) {
+         savedUs += entry->probeUs;
+      }
+   }
+   if (opts_.silent) {
+      return;
+   }
+   if (opts_.json) {
+      output_.Append([&](std::wstring& out) {
+         JsonRecord record(out);
+         record.String(L"cache", cache.matched ? L"hit" : L"miss");
+         record.Number(L"endpoints", total);
+         record.Number(L"hits", hits);
+         record.Number(L"saved_us", savedUs);
+      });
+      output_.Flush();
+   } else {
+      Print(
+         L"Cache %ls: %lld of %lld endpoints as expected, %.3f ms saved",
+         cache.matched ? L"hit" : L"miss", hits, total, savedUs / 1000.0);
+   }
+}
+
+static bool Mute(std::vector<Endpoint>& endpoints)
+{
+   const LONGLONG start = Now();
+   IMMDeviceEnumeratorPtr deviceEnumerator;
+   IMMDeviceCollectionPtr audioEndpoints;
+
+   if (!CreateDeviceEnumerator(deviceEnumerator)) {
+      return false;
+   }
+   if (opts_.action == Action::ToggleGroup
+       && !ResolveGroupState(deviceEnumerator)) {
+      return false;
+   }
+   HANDLE stateMapping = nullptr;
+   const void* stateView = nullptr;
+   if (opts_.action == Action::Restore
+       && !MapState(stateMapping, stateView)) {
+      UnmapState(stateMapping, stateView);
+      return false;
+   }
+   /* The default endpoint is processed first and goes last in the list,
+    * its place there is only known after the enumeration */
+   Endpoint defaultEp;
+   defaultEp.index = pendingIndex_;
+   const bool muteDefault = opts_.defaultFirst && opts_.ids.empty()
+      && MuteDefaultEndpoint(deviceEnumerator, defaultEp);
+   if (!opts_.ids.empty()) {
+      LookupEndpoints(deviceEnumerator, endpoints);
+   } else if (!EnumerateEndpoints(deviceEnumerator, audioEndpoints, endpoints)) {
+      FinishFades();
+      UnmapState(stateMapping, stateView);
+      return false;
+   }
+
+   const size_t enumerated = endpoints.size();
+   if (muteDefault) {
+      defaultEp.index = static_cast<UINT>(enumerated);
+      RelabelTrace(pendingIndex_, defaultEp.index);
+      endpoints.push_back(std::move(defaultEp));
+      MoveFades(&defaultEp, &endpoints.back());
+      ReportEndpoint(endpoints.back());
+   }
+   const std::span<Endpoint> listed =
+      std::span<Endpoint>(endpoints).first(enumerated);
+   DeviceCache cache;
+   if (!opts_.cachePath.empty()) {
+      ApplyCache(audioEndpoints, listed, cache);
+   }
+   RunEndpoints(audioEndpoints, listed);
+   FinishFades();
+   UnmapState(stateMapping, stateView);
+   if (opts_.stateMask != DEVICE_STATE_ACTIVE) {
+      ReportStates(endpoints);
+   }
+   if (!opts_.cachePath.empty()) {
+      ReportCache(listed, cache);
+      SaveCache(cache, listed);
+   }
+   nameCache_.Save();
+   if (opts_.json && !opts_.silent) {
+      ReportSummaryJson(endpoints, Now() - start);
+   }
+   if (opts_.save && !SaveState(endpoints)) {
+      return false;
+   }
+   for (const Endpoint& ep : endpoints) {
+      activationStats_.avoided += ep.handle.Unused();
+      if (measure_) {
+         RecordEndpointTimes(ep);
+      }
+   }
+
+   if (!opts_.apps.empty()
+       && std::none_of(endpoints.begin(), endpoints.end(),
+             [](const Endpoint& ep) { return ep.sessions != 0; })) {
+      PrintError(L"No audio sessions of the given applications found");
+      return false;
+   }
+   return true;
+}
+
+/* =============================================================================
+ *  Device Table
+ */
+
+/* Keeps track of every endpoint the system knows about. It is seeded by a
+ * single enumeration and kept up to date by endpoint notifications afterwards,
+ * so long-running modes never have to enumerate again. Every change bumps the
+ * generation, which lets callers tell cheaply whether anything changed. */
+class DeviceTable : public IMMNotificationClient {
+public:
+   bool Open(IMMDeviceEnumeratorPtr deviceEnumerator);
+   void Close();
+
+   /* Registers for notifications without seeding the table, for callers that
+    * only need arrivals and enumerate the endpoints themselves */
+   bool Listen(IMMDeviceEnumeratorPtr deviceEnumerator);
+
+   ULONGLONG Generation() const { return generation_; }
+   ULONGLONG Snapshot(std::vector<DeviceInfo>& devices);
+
+   /* Queues every device that is added or becomes active and signals wake,
+    * so they can be handled one by one without enumerating */
+   void WatchArrivals(HANDLE wake) { wake_ = wake; }
+   void TakeArrivals(std::vector<Arrival>& arrivals);
+
+   /* IUnknown, the table outlives its registration */
+   ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+   ULONG STDMETHODCALLTYPE Release() override { return 1; }
+   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** obj) override;
+
+   /* IMMNotificationClient */
+   HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(
+      LPCWSTR deviceId, DWORD newState) override;
+   HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR deviceId) override;
+   HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR deviceId) override;
+   HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(
+      EDataFlow flow, ERole role, LPCWSTR defaultDeviceId) override;
+   HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(
+      LPCWSTR deviceId, const PROPERTYKEY key) override;
+
+private:
+   /* A state or flow that has not been queried yet */
+   static const DWORD unknownState_ = 0;
+   static const EDataFlow unknownFlow_ = EDataFlow_enum_count;
+
+   struct Entry {
+      DWORD state = unknownState_;
+      EDataFlow flow = unknownFlow_;
+      bool renamed = false;
+      bool stateChanged = false;
+   };
+
+   void QueryDevice(IMMDevicePtr device, Entry& entry);
+   void Changed() { ++generation_; }
+   void Arrived(LPCWSTR deviceId, LONGLONG ticks);
+
+   IMMDeviceEnumeratorPtr deviceEnumerator_;
+   std::mutex lock_;
+   std::map<std::wstring, Entry> entries_;
+   std::wstring defaults_[eAll];
+   std::atomic<ULONGLONG> generation_ = 0;
+   bool registered_ = false;
+   HANDLE wake_ = nullptr;
+   std::vector<Arrival> arrivals_;
+};
+
+bool DeviceTable::Listen(IMMDeviceEnumeratorPtr deviceEnumerator)
+{
+   deviceEnumerator_ = deviceEnumerator;
+   if (FAILED(deviceEnumerator_->RegisterEndpointNotificationCallback(this))) {
+      PrintError(L"Failed to register for endpoint notifications");
+      return false;
+   }
+   registered_ = true;
+   return true;
+}
+
+bool DeviceTable::Open(IMMDeviceEnumeratorPtr deviceEnumerator)
+{
+   /* Register first, so that nothing happening during the enumeration is
+    * lost. Entries touched by a notification are newer than the seed. */
+   if (!Listen(deviceEnumerator)) {
+      return false;
+   }
+
+   IMMDeviceCollectionPtr devices;
+   UINT count = 0;
+   if (FAILED(deviceEnumerator_->EnumAudioEndpoints(
+         eAll, DEVICE_STATEMASK_ALL, &devices))
+       || FAILED(devices->GetCount(&count))) {
+      PrintError(L"Failed to enumerate all audio endpoints");
+      return false;
+   }
+   for (UINT i = 0; i < count; ++i) {
+      IMMDevicePtr device;
+      LPWSTR id = nullptr;
+      if (FAILED(devices->Item(i, &device)) || FAILED(device->GetId(&id))) {
+         continue;
+      }
+      Entry entry;
+      QueryDevice(device, entry);
+      {
+         std::lock_guard<std::mutex> guard(lock_);
+         entries_.try_emplace(id, entry);
+      }
+      CoTaskMemFree(id);
+   }
+
+   for (int flow = eRender; flow < eAll; ++flow) {
+      IMMDevicePtr device;
+      LPWSTR id = nullptr;
+      if (SUCCEEDED(deviceEnumerator_->GetDefaultAudioEndpoint(
+            static_cast<EDataFlow>(flow), eConsole, &device))
+          && SUCCEEDED(device->GetId(&id))) {
+         std::lock_guard<std::mutex> guard(lock_);
+         defaults_[flow] = id;
+         CoTaskMemFree(id);
+      }
+   }
+   Changed();
+   return true;
+}
+
+void DeviceTable::Close()
+{
+   if (registered_) {
+      deviceEnumerator_->UnregisterEndpointNotificationCallback(this);
+      registered_ = false;
+   }
+   deviceEnumerator_ = nullptr;
+}
+
+void DeviceTable::QueryDevice(IMMDevicePtr device, Entry& entry)
+{
+   DWORD state = unknownState_;
+   if (SUCCEEDED(device->GetState(&state))) {
+      entry.state = state;
+   }
+   IMMEndpointPtr endpoint;
+   EDataFlow flow = unknownFlow_;
+   if (SUCCEEDED(device.QueryInterface(__uuidof(IMMEndpoint), &endpoint))
+       && SUCCEEDED(endpoint->GetDataFlow(&flow))) {
+      entry.flow = flow;
+   }
+}
+
+/* Copies the current table and returns the generation it reflects. Devices
+ * that were announced by a notification are queried here rather than in the
+ * notification callback, which must not block. */
+ULONGLONG DeviceTable::Snapshot(std::vector<DeviceInfo>& devices)
+{
+   std::vector<std::wstring> pending;
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      for (const auto& [id, entry] : entries_) {
+         if (entry.state == unknownState_ || entry.flow == unknownFlow_) {
+            pending.push_back(id);
+         }
+      }
+   }
+   for (const std::wstring& id : pending) {
+      IMMDevicePtr device;
+      Entry entry;
+      if (SUCCEEDED(deviceEnumerator_->GetDevice(id.c_str(), &device))) {
+         QueryDevice(device, entry);
+      }
+      std::lock_guard<std::mutex> guard(lock_);
+      auto it = entries_.find(id);
+      if (it != entries_.end()) {
+         if (it->second.state == unknownState_) {
+            it->second.state = entry.state;
+         }
+         it->second.flow = entry.flow;
+      }
+   }
+
+   std::lock_guard<std::mutex> guard(lock_);
+   devices.clear();
+   devices.reserve(entries_.size());
+   for (auto& [id, entry] : entries_) {
+      const bool isDefault = entry.flow < eAll && defaults_[entry.flow] == id;
+      devices.push_back({ id, entry.state, entry.flow, isDefault,
+                          entry.renamed, entry.stateChanged });
+      entry.renamed = false;
+      entry.stateChanged = false;
+   }
+   return generation_;
+}
+
+HRESULT DeviceTable::QueryInterface(REFIID iid, void** obj)
+{
+   if (obj == nullptr) {
+      return E_POINTER;
+   }
+   if (iid == __uuidof(IUnknown) || iid == __uuidof(IMMNotificationClient)) {
+      *obj = static_cast<IMMNotificationClient*>(this);
+      return S_OK;
+   }
+   *obj = nullptr;
+   return E_NOINTERFACE;
+}
+
+void DeviceTable::TakeArrivals(std::vector<Arrival>& arrivals)
+{
+   std::lock_guard<std::mutex> guard(lock_);
+   arrivals.clear();
+   arrivals.swap(arrivals_);
+}
+
+void DeviceTable::Arrived(LPCWSTR deviceId, LONGLONG ticks)
+{
+   if (wake_ == nullptr) {
+      return;
+   }
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      arrivals_.push_back({ deviceId, ticks });
+   }
+   SetEvent(wake_);
+}
+
+HRESULT DeviceTable::OnDeviceStateChanged(LPCWSTR deviceId, DWORD newState)
+{
+   const LONGLONG ticks = Now();
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      Entry& entry = entries_[deviceId];
+      entry.stateChanged |= (entry.state != newState);
+      entry.state = newState;
+   }
+   Changed();
+   if (newState == DEVICE_STATE_ACTIVE) {
+      Arrived(deviceId, ticks);
+   }
+   return S_OK;
+}
+
+HRESULT DeviceTable::OnDeviceAdded(LPCWSTR deviceId)
+{
+   const LONGLONG ticks = Now();
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      entries_[deviceId].state = unknownState_;
+   }
+   Changed();
+   Arrived(deviceId, ticks);
+   return S_OK;
+}
+
+HRESULT DeviceTable::OnDeviceRemoved(LPCWSTR deviceId)
+{
+   {
+      /* Keep a tombstone, so a concurrent seed does not bring it back */
+      std::lock_guard<std::mutex> guard(lock_);
+      entries_[deviceId].state = DEVICE_STATE_NOTPRESENT;
+   }
+   Changed();
+   return S_OK;
+}
+
+HRESULT DeviceTable::OnDefaultDeviceChanged(
+   EDataFlow flow,
+   ERole role,
+   LPCWSTR defaultDeviceId)
+{
+   if (role != eConsole || flow >= eAll) {
+      return S_OK;
+   }
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      defaults_[flow] = (defaultDeviceId != nullptr) ? defaultDeviceId : L"";
+   }
+   Changed();
+   return S_OK;
+}
+
+HRESULT DeviceTable::OnPropertyValueChanged(
+   LPCWSTR deviceId,
+   const PROPERTYKEY key)
+{
+   if (deviceId == nullptr || key.fmtid != PKEY_Device_FriendlyName.fmtid
+       || key.pid != PKEY_Device_FriendlyName.pid) {
+      return S_OK;
+   }
+   nameCache_.Invalidate(deviceId);
+   {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto it = entries_.find(deviceId);
+      if (it == entries_.end()) {
+         return S_OK;
+      }
+      it->second.renamed = true;
+   }
+   Changed();
+   return S_OK;
+}
+
+/* =============================================================================
+ *  Daemon
+ */
+
+static BOOL WINAPI ConsoleCtrlHandler(DWORD ctrlType)
+{
+   UNREFERENCED_PARAMETER(ctrlType);
+   SetEvent(stopEvent_);
+   return TRUE;
+}
+
+/* Waits for an overlapped pipe operation, giving up when the daemon is
+ * asked to stop or the timeout expires. */
+static bool WaitPipeIo(
+   HANDLE pipe,
+   OVERLAPPED& ov,
+   BOOL started,
+   DWORD timeout,
+   DWORD* transferred)
+{
+   if (!started && GetLastError() != ERROR_IO_PENDING) {
+      return GetLastError() == ERROR_PIPE_CONNECTED;
+   }
+   const HANDLE handles[] = { ov.hEvent, stopEvent_ };
+   if (WaitForMultipleObjects(2, handles, FALSE, timeout) != WAIT_OBJECT_0) {
+      CancelIo(pipe);
+      GetOverlappedResult(pipe, &ov, transferred, TRUE);
+      return false;
+   }
+   return GetOverlappedResult(pipe, &ov, transferred, FALSE) != FALSE;
+}
+
+/* Brings the daemon's endpoints in line with the device table. Endpoints that
+ * are still there keep their activated interfaces. */
+static ULONGLONG SyncEndpoints(
+   DeviceTable& table,
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   std::vector<Endpoint>& endpoints)
+{
+   std::vector<DeviceInfo> devices;
+   const ULONGLONG generation = table.Snapshot(devices);
+
+   std::vector<Endpoint> synced;
+   for (const DeviceInfo& info : devices) {
+      if (info.flow >= eAll || (info.state & opts_.stateMask) == 0
+          || (opts_.flow != eAll && info.flow != opts_.flow)) {
+         continue;
+      }
+      if (!opts_.ids.empty()
+          && std::find(opts_.ids.begin(), opts_.ids.end(), info.id)
+             == opts_.ids.end()) {
+         continue;
+      }
+      auto it = std::find_if(
+         endpoints.begin(), endpoints.end(),
+         [&info](const Endpoint& ep) { return ep.id == info.id; });
+      if (it != endpoints.end()) {
+         synced.push_back(std::move(*it));
+         Endpoint& ep = synced.back();
+         if (info.renamed) {
+            ep.name.clear();
+         }
+         /* Interfaces activated before a state change may no longer work */
+         IMMDevicePtr device;
+         if (info.stateChanged
+             && SUCCEEDED(
+                deviceEnumerator->GetDevice(info.id.c_str(), &device))) {
+            ep.handle.Reset(device);
+         }
+         ep.state = info.state;
+      } else {
+         IMMDevicePtr device;
+         if (FAILED(deviceEnumerator->GetDevice(info.id.c_str(), &device))) {
+            continue;
+         }
+         Endpoint ep;
+         ep.id = info.id;
+         ep.flow = info.flow;
+         ep.state = info.state;
+         ep.handle.Reset(device);
+         synced.push_back(std::move(ep));
+      }
+      synced.back().index = static_cast<UINT>(synced.size() - 1);
+   }
+   endpoints.swap(synced);
+   return generation;
+}
+
+static bool HandleDaemonRequest(
+   DeviceTable& table,
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   std::vector<Endpoint>& endpoints,
+   ULONGLONG& generation,
+   const DaemonRequest& request,
+   std::wstring& report)
+{
+   capture_ = &report;
+   const Action action = static_cast<Action>(request.action);
+   bool success = false;
+   if (request.version != daemonProtocolVersion_
+       || request.action >= static_cast<DWORD>(Action::Restore)) {
+      PrintError(L"Unsupported request");
+   } else if (action != Action::ToggleGroup
+              || ResolveGroupState(deviceEnumerator)) {
+      if (table.Generation() != generation) {
+         generation = SyncEndpoints(table, deviceEnumerator, endpoints);
+      }
+      opts_.action = action;
+      {
+         /* Process IDs get reused while the daemon keeps running */
+         std::lock_guard<std::mutex> guard(processNamesLock_);
+         processNames_.clear();
+      }
+      for (Endpoint& ep : endpoints) {
+         ep.done = false;
+      }
+      RunEndpoints(nullptr, endpoints);
+      FinishFades();
+      success = true;
+   }
+   capture_ = nullptr;
+   return success;
+}
+
+static bool RunDaemon()
+{
+   IMMDeviceEnumeratorPtr deviceEnumerator;
+   DeviceTable table;
+   std::vector<Endpoint> endpoints;
+
+   if (!CreateDeviceEnumerator(deviceEnumerator)) {
+      return false;
+   }
+   if (!table.Open(deviceEnumerator)) {
+      table.Close();
+      return false;
+   }
+   ULONGLONG generation = SyncEndpoints(table, deviceEnumerator, endpoints);
+   for (Endpoint& ep : endpoints) {
+      IAudioEndpointVolumePtr endpointVolume;
+      if (ResolveEndpoint(nullptr, ep)) {
+         ep.handle.Volume(endpointVolume);
+      }
+   }
+
+   HANDLE pipe = CreateNamedPipeW(
+      daemonPipeName_,
+      PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+      PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT
+         | PIPE_REJECT_REMOTE_CLIENTS,
+      1, 64 * 1024, sizeof(DaemonRequest), 0, nullptr);
+   if (pipe == INVALID_HANDLE_VALUE) {
+      PrintError(L"Failed to create daemon pipe, is a daemon already running?");
+      table.Close();
+      return false;
+   }
+   stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+   OVERLAPPED ov = { 0 };
+   ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+   if (stopEvent_ == nullptr || ov.hEvent == nullptr) {
+      PrintError(L"Failed to create daemon events");
+      table.Close();
+      return false;
+   }
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+   Print(
+      L"Daemon is holding %u audio endpoints, press Ctrl+C to stop",
+      static_cast<UINT>(endpoints.size()));
+   FlushOutput();
+
+   const DWORD clientTimeout = 5000;
+   while (WaitForSingleObject(stopEvent_, 0) == WAIT_TIMEOUT) {
+      DWORD transferred = 0;
+      if (!WaitPipeIo(
+            pipe, ov, ConnectNamedPipe(pipe, &ov), INFINITE, &transferred)) {
+         DisconnectNamedPipe(pipe);
+         continue;
+      }
+
+      DaemonRequest request = { 0 };
+      if (WaitPipeIo(
+            pipe, ov,
+            ReadFile(pipe, &request, sizeof(request), nullptr, &ov),
+            clientTimeout, &transferred)
+          && transferred == sizeof(request)) {
+         std::wstring report;
+         const bool success = HandleDaemonRequest(
+            table, deviceEnumerator, endpoints, generation, request, report);
+
+         DaemonResponse header = {
+            daemonProtocolVersion_, static_cast<DWORD>(success)
+         };
+         std::vector<char> response(sizeof(header));
+         memcpy(response.data(), &header, sizeof(header));
+         const char* text = reinterpret_cast<const char*>(report.c_str());
+         response.insert(
+            response.end(), text, text + report.size() * sizeof(wchar_t));
+         if (WaitPipeIo(
+               pipe, ov,
+               WriteFile(
+                  pipe, response.data(), static_cast<DWORD>(response.size()),
+                  nullptr, &ov),
+               clientTimeout, &transferred)) {
+            FlushFileBuffers(pipe);
+         }
+      }
+      DisconnectNamedPipe(pipe);
+   }
+
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+   for (const Endpoint& ep : endpoints) {
+      activationStats_.avoided += ep.handle.Unused();
+   }
+   table.Close();
+   CloseHandle(ov.hEvent);
+   CloseHandle(pipe);
+   CloseHandle(stopEvent_);
+   stopEvent_ = nullptr;
+   return true;
+}
+
+/* Forwards the requested action to a running daemon and prints its report */
+static bool RunRemote()
+{
+   HANDLE pipe = CreateFileW(
+      daemonPipeName_, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+      OPEN_EXISTING, 0, nullptr);
+   if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY
+       && WaitNamedPipeW(daemonPipeName_, 5000)) {
+      pipe = CreateFileW(
+         daemonPipeName_, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+         OPEN_EXISTING, 0, nullptr);
+   }
+   if (pipe == INVALID_HANDLE_VALUE) {
+      PrintError(L"Failed to connect to the daemon, is it running?");
+      return false;
+   }
+   DWORD mode = PIPE_READMODE_MESSAGE;
+   SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr);
+
+   const DaemonRequest request = {
+      daemonProtocolVersion_,
+      static_cast<DWORD>(opts_.action)
+   };
+   DWORD transferred = 0;
+   if (!WriteFile(pipe, &request, sizeof(request), &transferred, nullptr)) {
+      PrintError(L"Failed to send request to the daemon");
+      CloseHandle(pipe);
+      return false;
+   }
+
+   std::vector<char> response;
+   BOOL complete = FALSE;
+   do {
+      char chunk[4096];
+      complete = ReadFile(pipe, chunk, sizeof(chunk), &transferred, nullptr);
+      if (!complete && GetLastError() != ERROR_MORE_DATA) {
+         break;
+      }
+      response.insert(response.end(), chunk, chunk + transferred);
+   } while (!complete);
+   CloseHandle(pipe);
+
+   DaemonResponse header = { 0 };
+   if (!complete || response.size() < sizeof(header)) {
+      PrintError(L"Failed to receive response from the daemon");
+      return false;
+   }
+   memcpy(&header, response.data(), sizeof(header));
+   std::wstring report(
+      (response.size() - sizeof(header)) / sizeof(wchar_t), L'\0');
+   memcpy(report.data(), response.data() + sizeof(header),
+          report.size() * sizeof(wchar_t));
+   if (!opts_.silent) {
+      output_.Text(report);
+   }
+   return header.version == daemonProtocolVersion_ && header.success;
+}
 
 /* =============================================================================
- *  Types
+ *  Enforce
  */
 
-struct Options {
-   bool silent;
-   bool unmute;
+/* Watches the volume of one endpoint and flags every change of its mute
+ * state that was made by someone else. The callback only records the time
+ * and wakes the enforcer, it must not call back into the endpoint. */
+class VolumeWatch : public IAudioEndpointVolumeCallback {
+public:
+   VolumeWatch(Endpoint& ep, IAudioEndpointVolumePtr volume, HANDLE wake)
+      : ep_(ep), volume_(volume), wake_(wake) {}
+
+   bool Register();
+   void Unregister();
+
+   Endpoint& Ep() { return ep_; }
+   IAudioEndpointVolumePtr Volume() { return volume_; }
+
+   /* When the state was last changed by others, 0 if it was not */
+   LONGLONG TakeChange() { return changedAt_.exchange(0); }
+
+   /* IUnknown, the watch outlives its registration */
+   ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+   ULONG STDMETHODCALLTYPE Release() override { return 1; }
+   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** obj) override;
+
+   /* IAudioEndpointVolumeCallback */
+   HRESULT STDMETHODCALLTYPE OnNotify(
+      PAUDIO_VOLUME_NOTIFICATION_DATA data) override;
+
+private:
+   Endpoint& ep_;
+   IAudioEndpointVolumePtr volume_;
+   const HANDLE wake_;
+   std::atomic<LONGLONG> changedAt_ = 0;
+   bool registered_ = false;
 };
 
-_COM_SMARTPTR_TYPEDEF(IPropertyStore, __uuidof(IPropertyStore));
-_COM_SMARTPTR_TYPEDEF(IMMDevice, __uuidof(IMMDevice));
-_COM_SMARTPTR_TYPEDEF(IMMDeviceCollection, __uuidof(IMMDeviceCollection));
-_COM_SMARTPTR_TYPEDEF(IAudioSessionManager2, __uuidof(IAudioSessionManager2));
-_COM_SMARTPTR_TYPEDEF(IAudioEndpointVolume, __uuidof(IAudioEndpointVolume));
-_COM_SMARTPTR_TYPEDEF(IMMDeviceEnumerator, __uuidof(IMMDeviceEnumerator));
-_COM_SMARTPTR_TYPEDEF(IAudioSessionControl, __uuidof(IAudioSessionControl));
+bool VolumeWatch::Register()
+{
+   registered_ = SUCCEEDED(volume_->RegisterControlChangeNotify(this));
+   return registered_;
+}
 
-/* =============================================================================
- *  Globals
- */
+void VolumeWatch::Unregister()
+{
+   if (registered_) {
+      volume_->UnregisterControlChangeNotify(this);
+      registered_ = false;
+   }
+}
 
-static const char* programName_ = nullptr;
-static struct Options opts_ = { 0 };
+HRESULT VolumeWatch::QueryInterface(REFIID iid, void** obj)
+{
+   if (obj == nullptr) {
+      return E_POINTER;
+   }
+   if (iid == __uuidof(IUnknown)
+       || iid == __uuidof(IAudioEndpointVolumeCallback)) {
+      *obj = static_cast<IAudioEndpointVolumeCallback*>(this);
+      return S_OK;
+   }
+   *obj = nullptr;
+   return E_NOINTERFACE;
+}
 
-/* =============================================================================
- *  Output
- */
+HRESULT VolumeWatch::OnNotify(PAUDIO_VOLUME_NOTIFICATION_DATA data)
+{
+   const bool mute = (opts_.action == Action::Mute);
+   if (data == nullptr || IsEqualGUID(data->guidEventContext, eventContext_)
+       || (data->bMuted != FALSE) == mute) {
+      return S_OK;
+   }
+   LONGLONG expected = 0;
+   changedAt_.compare_exchange_strong(expected, Now());
+   SetEvent(wake_);
+   return S_OK;
+}
 
-static void PrintError(const wchar_t* fmt, ...)
+/* Puts the endpoint back into the enforced state and reports how long the
+ * change was audible */
+static void Enforce(VolumeWatch& watch, LONGLONG changedAt)
 {
-   if (opts_.silent) {
+   Endpoint& ep = watch.Ep();
+   const bool mute = (opts_.action == Action::Mute);
+   HRESULT hr;
+   {
+      PhaseSpan span(Phase::SetMute, &ep);
+      hr = watch.Volume()->SetMute(mute, &eventContext_);
+   }
+   const LONGLONG latency = Now() - changedAt;
+   if (FAILED(hr)) {
+      PrintError(
+         L"Failed to set mute status for device \"%ls\"",
+         ep.name.c_str());
+      FlushOutput();
       return;
    }
-   va_list ap;
-   va_start(ap, fmt);
-   fputs("! ", stdout);
-   vfwprintf(stderr, fmt, ap);
-   fputs("\n", stderr);
-   va_end(ap);
+   ++enforceStats_.reactions;
+   enforceStats_.latency += latency;
+   enforceStats_.maxLatency = std::max(enforceStats_.maxLatency, latency);
+
+   if (opts_.json) {
+      if (!opts_.silent) {
+         output_.Append([&](std::wstring& out) {
+            JsonRecord record(out);
+            record.String(L"id", ep.id.c_str());
+            record.String(L"name", ep.name.c_str());
+            record.String(L"event", L"enforced");
+            record.Literal(L"state", MuteStateName(mute));
+            record.Number(L"latency_us", TicksToUs(latency));
+         });
+      }
+   } else {
+      Print(
+         L"> %ls was %lsmuted by someone else, %lsmuted again after %.3f ms",
+         ep.name.c_str(), mute ? L"un" : L"", mute ? L"" : L"un",
+         TicksToMs(latency));
+   }
+   FlushOutput();
 }
 
-static void Print(const wchar_t* fmt, ...)
+/* Applies the action once and then keeps every endpoint in that state until
+ * Ctrl+C, reacting to volume notifications instead of polling */
+static bool RunEnforce()
 {
-   if (opts_.silent) {
-      return;
+   std::vector<Endpoint> endpoints;
+   if (!Mute(endpoints)) {
+      return false;
    }
-   va_list ap;
-   va_start(ap, fmt);
-   vwprintf(fmt, ap);
-   fputs("\n", stdout);
-   va_end(ap);
+
+   stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+   HANDLE wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+   if (stopEvent_ == nullptr || wake == nullptr) {
+      PrintError(L"Failed to create enforce events");
+      return false;
+   }
+
+   std::vector<std::unique_ptr<VolumeWatch>> watches;
+   for (Endpoint& ep : endpoints) {
+      IAudioEndpointVolumePtr volume;
+      if ((ep.status == EndpointStatus::Changed
+           || ep.status == EndpointStatus::Unchanged)
+          && SUCCEEDED(ep.handle.Volume(volume))) {
+         auto watch = std::make_unique<VolumeWatch>(ep, volume, wake);
+         if (watch->Register()) {
+            watches.push_back(std::move(watch));
+         }
+      }
+   }
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+   if (!opts_.json) {
+      Print(
+         L"Enforcing the state of %u audio endpoints, press Ctrl+C to stop",
+         static_cast<UINT>(watches.size()));
+   }
+   FlushOutput();
+
+   const HANDLE events[] = { stopEvent_, wake };
+   while (WaitForMultipleObjects(2, events, FALSE, INFINITE)
+          == WAIT_OBJECT_0 + 1) {
+      for (const auto& watch : watches) {
+         const LONGLONG changedAt = watch->TakeChange();
+         if (changedAt != 0) {
+            Enforce(*watch, changedAt);
+         }
+      }
+   }
+
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+   for (const auto& watch : watches) {
+      watch->Unregister();
+   }
+   CloseHandle(wake);
+   CloseHandle(stopEvent_);
+   stopEvent_ = nullptr;
+   return true;
 }
 
 /* =============================================================================
- *  Mute
+ *  Auto Mute
  */
 
-static void MuteEndpoint(
-   IAudioEndpointVolumePtr ev,
-   const std::wstring& deviceName)
+/* Handles a single device that just arrived. Only this device is resolved
+ * and activated, nothing else gets enumerated. */
+static void HandleArrival(
+   IMMDeviceEnumeratorPtr deviceEnumerator,
+   const Arrival& arrival)
 {
-   BOOL isMuted = FALSE;
-   HRESULT hr = ev->GetMute(&isMuted);
-   if (FAILED(hr)) {
-      PrintError(
-         L"Failed to get mute status for device \"%ls\"",
-         deviceName.c_str());
+   if (!opts_.ids.empty()
+       && std::find(opts_.ids.begin(), opts_.ids.end(), arrival.id)
+          == opts_.ids.end()) {
       return;
    }
-   if (opts_.unmute && !isMuted) {
-      Print(L"> %ls is already unmuted.", deviceName.c_str());
+   IMMDevicePtr device;
+   IMMEndpointPtr endpoint;
+   DWORD state = 0;
+   EDataFlow flow = eRender;
+   if (FAILED(deviceEnumerator->GetDevice(arrival.id.c_str(), &device))
+       || FAILED(device->GetState(&state)) || state != DEVICE_STATE_ACTIVE
+       || FAILED(device.QueryInterface(__uuidof(IMMEndpoint), &endpoint))
+       || FAILED(endpoint->GetDataFlow(&flow))
+       || (opts_.flow != eAll && flow != opts_.flow)) {
       return;
-   } else if (!opts_.unmute && isMuted) {
-      Print(L"> %ls is already muted.", deviceName.c_str());
+   }
+
+   /* A slot of its own in the timings, which label its trace events */
+   Endpoint ep;
+   ep.index = static_cast<UINT>(endpointTimes_.size());
+   ep.id = arrival.id;
+   ep.flow = flow;
+   ep.handle.Reset(device);
+   ProcessEndpoint(nullptr, ep);
+   RunFades();
+   if (measure_) {
+      RecordEndpointTimes(ep);
+   }
+   if (ep.status >= EndpointStatus::Skipped) {
+      FlushOutput();
       return;
    }
 
-   hr = ev->SetMute(!opts_.unmute, nullptr);
-   if (FAILED(hr)) {
-      PrintError(
-         L"Failed to set mute status for device \"%ls\"",
-         deviceName.c_str());
+   const LONGLONG latency = Now() - arrival.ticks;
+   RecordLatency(arrivalLatency_, latency);
+   if (opts_.json) {
+      if (!opts_.silent) {
+         output_.Append([&](std::wstring& out) {
+            JsonRecord record(out);
+            record.String(L"id", ep.id.c_str());
+            record.String(L"event", L"arrived");
+            record.Number(L"latency_us", TicksToUs(latency));
+         });
+      }
    } else {
       Print(
-         L"> %ls is now %lsmuted",
-         deviceName.c_str(),
-         (opts_.unmute) ? L"un" : L"");
+         L"New audio endpoint, handled %.3f ms after it arrived",
+         TicksToMs(latency));
    }
+   ReportEndpoint(ep);
+   FlushOutput();
 }
 
-static bool Mute()
+/* Applies the action to all endpoints once and then to every endpoint that
+ * shows up later, until Ctrl+C */
+static bool RunAutoMute()
 {
    IMMDeviceEnumeratorPtr deviceEnumerator;
-
-   if (FAILED(deviceEnumerator.CreateInstance(
-         __uuidof(MMDeviceEnumerator),
-         nullptr,
-         CLSCTX_INPROC_SERVER))) {
-      PrintError(L"Failed to create instance of MMDeviceEnumerator");
+   DeviceTable table;
+   if (!CreateDeviceEnumerator(deviceEnumerator)) {
       return false;
    }
-
-   IMMDeviceCollectionPtr audioEndpoints;
-   HRESULT hr = deviceEnumerator->EnumAudioEndpoints(
-      eRender,
-      DEVICE_STATE_ACTIVE,
-      &audioEndpoints);
-   if (FAILED(hr)) {
-      PrintError(L"Failed to enumerate all audio endpoints");
+   stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+   HANDLE wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+   if (stopEvent_ == nullptr || wake == nullptr) {
+      PrintError(L"Failed to create auto-mute events");
       return false;
    }
 
-   UINT epCount;
-   hr = audioEndpoints->GetCount(&epCount);
-   if (FAILED(hr)) {
-      PrintError(L"Failed to get endpoint count");
+   /* Listen first, so nothing that arrives during the first pass is lost.
+    * Only arrivals are needed, the first pass enumerates on its own. */
+   table.WatchArrivals(wake);
+   std::vector<Endpoint> endpoints;
+   if (!table.Listen(deviceEnumerator) || !Mute(endpoints)) {
+      table.Close();
       return false;
    }
+   /* Only meant for the first pass, a new default must not be skipped */
+   defaultEndpointId_.clear();
 
-   for (UINT i = 0; i < epCount; ++i) {
-      IMMDevicePtr device = nullptr;
-      IPropertyStorePtr propStore;
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+   if (!opts_.json) {
+      Print(L"Waiting for new audio endpoints, press Ctrl+C to stop");
+   }
+   FlushOutput();
 
-      hr = audioEndpoints->Item(i, &device);
-      if (FAILED(hr)) {
-         PrintError(L"Failed to get audio endpoint #%d", i);
-         continue;
+   std::vector<Arrival> arrivals;
+   const HANDLE events[] = { stopEvent_, wake };
+   while (WaitForMultipleObjects(2, events, FALSE, INFINITE)
+          == WAIT_OBJECT_0 + 1) {
+      table.TakeArrivals(arrivals);
+      for (size_t i = 0; i < arrivals.size(); ++i) {
+         /* Added and activated usually come together */
+         auto seen = std::find_if(
+            arrivals.begin(), arrivals.begin() + i,
+            [&](const Arrival& a) { return a.id == arrivals[i].id; });
+         if (seen == arrivals.begin() + i) {
+            HandleArrival(deviceEnumerator, arrivals[i]);
+         }
       }
+   }
 
-      hr = device->OpenPropertyStore(STGM_READ, &propStore);
-      if (FAILED(hr)) {
-         PrintError(L"Failed to open property store for audio endpoint #%d", i);
-         continue;
-      }
+   SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+   table.Close();
+   CloseHandle(wake);
+   CloseHandle(stopEvent_);
+   stopEvent_ = nullptr;
+   return true;
+}
 
-      PROPVARIANT value;
-      PropVariantInit(&value);
-      hr = propStore->GetValue(PKEY_Device_FriendlyName, &value);
-      if (FAILED(hr)) {
-         PrintError(L"Failed to get device name for audio endpoint #%d");
-         continue;
+/* =============================================================================
+ *  Single Flight
+ */
+
+static void ReportReused(const FlightSlot& slot)
+{
+   if (opts_.json) {
+      if (!opts_.silent) {
+         output_.Append([&slot](std::wstring& out) {
+            JsonRecord record(out);
+            record.Literal(L"summary", L"true");
+            record.Literal(L"reused", L"true");
+            record.Number(L"endpoints", slot.endpoints);
+            record.Number(L"changed", slot.changed);
+            record.Literal(L"success", slot.success ? L"true" : L"false");
+         });
       }
-      std::wstring deviceName = value.pwszVal;
-      PropVariantClear(&value);
+      return;
+   }
+   Print(
+      L"An identical run just finished, reusing its result "
+      L"(%lu endpoints, %lu changed)",
+      slot.endpoints, slot.changed);
+}
+
+/* Fills sa with the security descriptor sddl describes, which the caller
+ * releases with LocalFree */
+static bool FlightSecurity(const wchar_t* sddl, SECURITY_ATTRIBUTES& sa)
+{
+   sa.nLength = sizeof(sa);
+   sa.lpSecurityDescriptor = nullptr;
+   sa.bInheritHandle = FALSE;
+   return ConvertStringSecurityDescriptorToSecurityDescriptorW(
+             sddl, SDDL_REVISION_1, &sa.lpSecurityDescriptor, nullptr)
+          != FALSE;
+}
 
-      Print(L"Found audio endpoint \"%ls\"", deviceName.c_str());
+/* Asks only for the access every instance is granted, so that it also opens
+ * a mutex another user created */
+static HANDLE OpenFlightMutex()
+{
+   SECURITY_ATTRIBUTES sa;
+   if (!FlightSecurity(flightMutexSddl_, sa)) {
+      return nullptr;
+   }
+   HANDLE mutex = CreateMutexExW(
+      &sa, flightMutexName_, 0, SYNCHRONIZE | MUTEX_MODIFY_STATE);
+   LocalFree(sa.lpSecurityDescriptor);
+   return mutex;
+}
 
-      IAudioSessionManager2Ptr sessionManager2;
-      if (FAILED(device->Activate(
-            __uuidof(IAudioSessionManager2), CLSCTX_INPROC_SERVER, nullptr,
-            reinterpret_cast<LPVOID*>(&sessionManager2)))) {
-         PrintError(
-            L"Failed to retrieve audio session manager for \"%ls\"",
-            deviceName.c_str());
-         continue;
-      }
+/* Opens the slot, or creates it for the first instance. Creating asks for
+ * full access to an existing slot, which other users are not granted. */
+static HANDLE OpenFlightSlot()
+{
+   HANDLE mapping = OpenFileMappingW(
+      FILE_MAP_READ | FILE_MAP_WRITE, FALSE, flightSlotName_);
+   SECURITY_ATTRIBUTES sa;
+   if (mapping != nullptr || !FlightSecurity(flightSlotSddl_, sa)) {
+      return mapping;
+   }
+   mapping = CreateFileMappingW(
+      INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, sizeof(FlightSlot),
+      flightSlotName_);
+   LocalFree(sa.lpSecurityDescriptor);
+   /* Another user's instance created it in between */
+   if (mapping == nullptr && GetLastError() == ERROR_ACCESS_DENIED) {
+      mapping = OpenFileMappingW(
+         FILE_MAP_READ | FILE_MAP_WRITE, FALSE, flightSlotName_);
+   }
+   return mapping;
+}
 
-      IAudioSessionControlPtr sessionCtrl;
-      hr = sessionManager2->GetAudioSessionControl(nullptr, 0, &sessionCtrl);
-      if (FAILED(hr)) {
-         PrintError(
-            L"Failed to retrieve audio session manager for \"%ls\"",
-            deviceName.c_str());
-         continue;
+/* Runs one instance at a time on this host. An instance that had to wait
+ * for an identical run takes over its result instead of repeating it,
+ * conflicting ones run after each other, so the last one wins. */
+static bool RunSingleFlight()
+{
+   HANDLE mutex = OpenFlightMutex();
+   HANDLE mapping = (mutex != nullptr) ? OpenFlightSlot() : nullptr;
+   FlightSlot* slot = (mapping != nullptr)
+      ? static_cast<FlightSlot*>(MapViewOfFile(
+           mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(FlightSlot)))
+      : nullptr;
+   /* A per-session fallback would not see the instances in other sessions,
+    * so coordinating there would only pretend to */
+   if (mutex == nullptr || slot == nullptr) {
+      PrintError(
+         L"Failed to set up single flight across sessions, running without "
+         L"coordination");
+      if (slot != nullptr) {
+         UnmapViewOfFile(slot);
       }
-
-      IAudioEndpointVolumePtr endpointVolume;
-      hr = device->Activate(
-         __uuidof(IAudioEndpointVolume), CLSCTX_INPROC_SERVER,
-         nullptr, reinterpret_cast<LPVOID*>(&endpointVolume));
-      if (FAILED(hr)) {
-         PrintError(
-            L"Failed to active endpoint volume for device \"%ls\"",
-            deviceName.c_str());
-         continue;
+      if (mapping != nullptr) {
+         CloseHandle(mapping);
+      }
+      if (mutex != nullptr) {
+         CloseHandle(mutex);
       }
+      std::vector<Endpoint> endpoints;
+      return Mute(endpoints);
+   }
 
-      MuteEndpoint(endpointVolume, deviceName);
-      fputs("\n", stdout);
+   /* Toggles and snapshots depend on the state before, so they are never
+    * taken over */
+   const bool reusable = (opts_.action == Action::Mute
+                          || opts_.action == Action::Unmute)
+                         && !opts_.save;
+   const LONG arrived = InterlockedCompareExchange(&slot->sequence, 0, 0);
+   const DWORD wait = WaitForSingleObject(mutex, INFINITE);
+   if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED) {
+      PrintError(L"Failed to wait for the running instance");
+      UnmapViewOfFile(slot);
+      CloseHandle(mapping);
+      CloseHandle(mutex);
+      return false;
    }
 
-   return true;
+   bool success;
+   if (reusable && slot->sequence != arrived
+       && slot->key == opts_.requestKey) {
+      success = slot->success != FALSE;
+      ReportReused(*slot);
+   } else {
+      std::vector<Endpoint> endpoints;
+      success = Mute(endpoints);
+      slot->key = reusable ? opts_.requestKey : 0;
+      slot->success = success;
+      slot->endpoints = 0;
+      slot->changed = 0;
+      for (const Endpoint& ep : endpoints) {
+         slot->endpoints += (ep.status < EndpointStatus::Skipped);
+         slot->changed += (ep.status == EndpointStatus::Changed);
+      }
+      InterlockedIncrement(&slot->sequence);
+   }
+
+   ReleaseMutex(mutex);
+   UnmapViewOfFile(slot);
+   CloseHandle(mapping);
+   CloseHandle(mutex);
+   return success;
 }
 
 /* =============================================================================
@@ -248,7 +4935,50 @@ static void PrintUsage()
       "Options:\n"
       "\t-help\tDisplay this screen and exits\n"
       "\t-silent\tDon't print any output\n"
-      "\t-unmute\tinstead of muting, do the opposite\n",
+      "\t-unmute\tinstead of muting, do the opposite\n"
+      "\t-status\tOnly print whether each endpoint is muted\n"
+      "\t-toggle\tFlip the state of each endpoint\n"
+      "\t-toggle-group\tFlip the default endpoint, the others follow it\n"
+      "\t-capture\tMute recording endpoints instead of playback ones\n"
+      "\t-all\tMute both playback and recording endpoints\n"
+      "\t-include-inactive\tAlso mute disabled and unplugged endpoints\n"
+      "\t-default-first\tMute the default endpoint before all others\n"
+      "\t-id ID\tOnly mute the endpoint with this ID, may be repeated\n"
+      "\t-include FIELD:GLOB\tOnly mute endpoints matching GLOB, may be "
+      "repeated\n"
+      "\t-exclude FIELD:GLOB\tNever mute endpoints matching GLOB, may be "
+      "repeated\n"
+      "\t\tFIELD is one of name, id, flow or formfactor (e.g. hdmi)\n"
+      "\t-app EXE|PID\tOnly mute the sessions of this application, may be "
+      "repeated\n"
+      "\t-channels LIST\tOnly mute these channels, e.g. 4-7 or 2-3:-12\n"
+      "\t\tChannels count from 0, :DB attenuates the range before it\n"
+      "\t\tinstead of silencing it\n"
+      "\t-fade MS\tRamp the volume over MS milliseconds around (un)muting\n"
+      "\t-save FILE\tWrite the state of all endpoints to FILE first\n"
+      "\t-restore FILE\tPut back the state saved in FILE\n"
+      "\t-cache FILE\tRemember names and states in FILE between runs\n"
+      "\t-trust-cache\tSkip endpoints the cache says are done already\n"
+      "\t-name-cache FILE\tKeep endpoint names in FILE between runs\n"
+      "\t-jobs N\tProcess up to N endpoints concurrently\n"
+      "\t-timeout MS\tGive up on hung endpoints and exit with 2 after MS "
+      "milliseconds\n"
+      "\t-endpoint-timeout MS\tWith -timeout, give up on a single "
+      "endpoint after MS\n"
+      "\t\tmilliseconds and go on with the next, a quarter of -timeout by "
+      "default\n"
+      "\t-pipeline\tOverlap the steps of consecutive endpoints\n"
+      "\t-enforce\tStay resident and undo every change made by others\n"
+      "\t-auto-mute\tStay resident and also mute every new endpoint\n"
+      "\t-daemon\tStay resident and serve requests from -remote\n"
+      "\t-single-flight\tWait for other instances, reuse an identical "
+      "run\n"
+      "\t-remote\tSend the action to a running daemon, which selects "
+      "the endpoints\n\t\tthe way it was started\n"
+      "\t-timings [table|json]\tPrint where the time went at exit\n"
+      "\t-trace FILE\tWrite every backend call to FILE as trace events\n"
+      "\t-flush N\tWrite output whenever N characters are buffered\n"
+      "\t-json\tPrint one JSON object per endpoint and a summary\n",
       programName_);
 }
 
@@ -260,30 +4990,310 @@ static bool DisplayUsage(int argc, char** argv)
    return false;
 }
 
+static std::wstring Widen(const char* arg)
+{
+   const int len = MultiByteToWideChar(CP_ACP, 0, arg, -1, nullptr, 0);
+   if (len <= 1) {
+      return std::wstring();
+   }
+   std::wstring wide(len - 1, L'\0');
+   MultiByteToWideChar(CP_ACP, 0, arg, -1, wide.data(), len);
+   return wide;
+}
+
+/* Requests for the same target state on the same endpoints get the same
+ * key, however the options were ordered and whatever they print */
+static ULONGLONG RequestKey()
+{
+   wchar_t number[64];
+   swprintf(
+      number, 64, L"%d %d %lu\n", static_cast<int>(opts_.action),
+      static_cast<int>(opts_.flow), opts_.stateMask);
+   std::wstring key = number;
+
+   std::vector<std::wstring> targets(opts_.ids.begin(), opts_.ids.end());
+   for (const AppTarget& app : opts_.apps) {
+      swprintf(number, 64, L"pid %lu", app.pid);
+      targets.push_back(app.exe.empty() ? number : app.exe);
+   }
+   std::sort(targets.begin(), targets.end());
+   for (const std::wstring& target : targets) {
+      key += target;
+      key += L'\n';
+   }
+   for (const ChannelRule& rule : opts_.channels) {
+      swprintf(
+         number, 64, L"%u-%u:%.9g\n", rule.first, rule.last, rule.gain);
+      key += number;
+   }
+   key += filter_.Key();
+   return HashId(key);
+}
+
+static bool ParseUnsigned(const char* arg, unsigned& value)
+{
+   char* end = nullptr;
+   const unsigned long parsed = strtoul(arg, &end, 10);
+   if (end == arg || *end != '\0' || parsed > UINT_MAX) {
+      return false;
+   }
+   value = static_cast<unsigned>(parsed);
+   return true;
+}
+
+/* Takes a process ID or an executable name, ".exe" may be left out */
+static bool ParseApp(const char* arg)
+{
+   AppTarget target = { 0 };
+   unsigned pid = 0;
+   if (ParseUnsigned(arg, pid)) {
+      target.pid = pid;
+   } else {
+      target.exe = Widen(arg);
+      if (target.exe.empty()) {
+         return false;
+      }
+      for (wchar_t& c : target.exe) {
+         c = static_cast<wchar_t>(towlower(c));
+      }
+      if (target.exe.find(L'.') == std::wstring::npos) {
+         target.exe += L".exe";
+      }
+   }
+   opts_.apps.push_back(target);
+   return true;
+}
+
+/* Takes N[-M][:DB] ranges separated by commas, a gain only applies to the
+ * range it is attached to */
+static bool ParseChannels(const char* arg)
+{
+   const char* p = arg;
+   while (*p != '\0') {
+      char* end = nullptr;
+      ChannelRule rule = { 0 };
+      rule.first = static_cast<UINT>(strtoul(p, &end, 10));
+      rule.last = rule.first;
+      if (end == p) {
+         return false;
+      }
+      p = end;
+      if (*p == '-') {
+         rule.last = static_cast<UINT>(strtoul(++p, &end, 10));
+         if (end == p || rule.last < rule.first) {
+            return false;
+         }
+         p = end;
+      }
+      if (*p == ':') {
+         const double db = strtod(++p, &end);
+         /* Also rules out NaN, a gain that would silence the channel */
+         if (end == p || !(db <= 0.0)) {
+            return false;
+         }
+         rule.gain = static_cast<float>(std::pow(10.0, db / 20.0));
+         p = end;
+      }
+      opts_.channels.push_back(rule);
+      if (*p == ',') {
+         ++p;
+      } else if (*p != '\0') {
+         return false;
+      }
+   }
+   return !opts_.channels.empty();
+}
+
 static bool ParseCommandLine(int argc, char** argv)
 {
    for (int i = 1; i < argc; ++i) {
       if (_strcmpi(argv[i], "-silent") == 0) {
          opts_.silent = 1;
       } else if (_strcmpi(argv[i], "-unmute") == 0) {
-         opts_.unmute = 1;
+         opts_.action = Action::Unmute;
+      } else if (_strcmpi(argv[i], "-status") == 0) {
+         opts_.action = Action::Status;
+      } else if (_strcmpi(argv[i], "-toggle") == 0) {
+         opts_.action = Action::Toggle;
+      } else if (_strcmpi(argv[i], "-toggle-group") == 0) {
+         opts_.action = Action::ToggleGroup;
+      } else if (_strcmpi(argv[i], "-save") == 0 && i + 1 < argc) {
+         opts_.save = true;
+         opts_.statePath = argv[++i];
+      } else if (_strcmpi(argv[i], "-restore") == 0 && i + 1 < argc) {
+         opts_.action = Action::Restore;
+         opts_.statePath = argv[++i];
+      } else if (_strcmpi(argv[i], "-capture") == 0) {
+         opts_.flow = eCapture;
+      } else if (_strcmpi(argv[i], "-all") == 0) {
+         opts_.flow = eAll;
+      } else if (_strcmpi(argv[i], "-include-inactive") == 0) {
+         opts_.stateMask |= DEVICE_STATE_DISABLED | DEVICE_STATE_UNPLUGGED;
+      } else if (_strcmpi(argv[i], "-default-first") == 0) {
+         opts_.defaultFirst = true;
+      } else if (_strcmpi(argv[i], "-pipeline") == 0) {
+         opts_.pipeline = true;
+      } else if (_strcmpi(argv[i], "-id") == 0 && i + 1 < argc) {
+         opts_.ids.push_back(Widen(argv[++i]));
+      } else if (_strcmpi(argv[i], "-app") == 0 && i + 1 < argc) {
+         if (!ParseApp(argv[++i])) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-include") == 0 && i + 1 < argc) {
+         if (!filter_.Add(Widen(argv[++i]), false)) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-exclude") == 0 && i + 1 < argc) {
+         if (!filter_.Add(Widen(argv[++i]), true)) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-enforce") == 0) {
+         opts_.enforce = true;
+      } else if (_strcmpi(argv[i], "-auto-mute") == 0) {
+         opts_.autoMute = true;
+      } else if (_strcmpi(argv[i], "-single-flight") == 0) {
+         opts_.singleFlight = true;
+      } else if (_strcmpi(argv[i], "-cache") == 0 && i + 1 < argc) {
+         opts_.cachePath = argv[++i];
+      } else if (_strcmpi(argv[i], "-trust-cache") == 0) {
+         opts_.trustCache = true;
+      } else if (_strcmpi(argv[i], "-name-cache") == 0 && i + 1 < argc) {
+         opts_.nameCachePath = argv[++i];
+      } else if (_strcmpi(argv[i], "-daemon") == 0) {
+         opts_.daemon = true;
+      } else if (_strcmpi(argv[i], "-remote") == 0) {
+         opts_.remote = true;
+      } else if (_strcmpi(argv[i], "-timings") == 0) {
+         opts_.timings = true;
+         if (i + 1 < argc && _strcmpi(argv[i + 1], "json") == 0) {
+            opts_.timingsJson = true;
+            ++i;
+         } else if (i + 1 < argc && _strcmpi(argv[i + 1], "table") == 0) {
+            ++i;
+         }
+      } else if (_strcmpi(argv[i], "-trace") == 0 && i + 1 < argc) {
+         opts_.tracePath = argv[++i];
+      } else if (_strcmpi(argv[i], "-json") == 0) {
+         opts_.json = true;
+      } else if (_strcmpi(argv[i], "-flush") == 0 && i + 1 < argc) {
+         if (!ParseUnsigned(argv[++i], opts_.flushThreshold)) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-channels") == 0 && i + 1 < argc) {
+         if (!ParseChannels(argv[++i])) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-fade") == 0 && i + 1 < argc) {
+         if (!ParseUnsigned(argv[++i], opts_.fadeMs)) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-timeout") == 0 && i + 1 < argc) {
+         if (!ParseUnsigned(argv[++i], opts_.timeoutMs)
+             || opts_.timeoutMs == 0) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-endpoint-timeout") == 0
+                 && i + 1 < argc) {
+         if (!ParseUnsigned(argv[++i], opts_.endpointTimeoutMs)
+             || opts_.endpointTimeoutMs == 0) {
+            return false;
+         }
+      } else if (_strcmpi(argv[i], "-jobs") == 0 && i + 1 < argc) {
+         if (!ParseUnsigned(argv[++i], opts_.jobs) || opts_.jobs == 0) {
+            return false;
+         }
       } else {
          return false;
       }
    }
-   return true;
+   if (!opts_.channels.empty()
+       && (opts_.action > Action::Status || !opts_.apps.empty()
+           || opts_.save)) {
+      return false;
+   }
+   if (opts_.singleFlight
+       && (opts_.daemon || opts_.remote || opts_.enforce || opts_.autoMute)) {
+      return false;
+   }
+   if ((opts_.enforce || opts_.autoMute)
+       && (opts_.action > Action::Unmute || opts_.daemon || opts_.remote
+           || (opts_.enforce && opts_.autoMute)
+           || !opts_.apps.empty() || !opts_.channels.empty())) {
+      return false;
+   }
+   if (!opts_.statePath.empty()
+       && (opts_.save == (opts_.action == Action::Restore)
+           || opts_.daemon || opts_.remote || !opts_.apps.empty())) {
+      return false;
+   }
+   if ((opts_.trustCache && opts_.cachePath.empty())
+       || (!opts_.cachePath.empty()
+           && (opts_.action == Action::Restore || opts_.daemon || opts_.remote
+               || opts_.enforce || opts_.autoMute || !opts_.apps.empty()
+               || !opts_.channels.empty()))) {
+      return false;
+   }
+   /* The daemon selects and reports endpoints the way it was started, the
+    * request only carries the action */
+   if (opts_.remote
+       && (!opts_.nameCachePath.empty() || !opts_.ids.empty()
+           || opts_.flow != eRender || opts_.stateMask != DEVICE_STATE_ACTIVE
+           || !filter_.Empty() || !opts_.apps.empty()
+           || !opts_.channels.empty() || opts_.json || opts_.jobs != 1)) {
+      return false;
+   }
+   if (opts_.timeoutMs != 0
+       && (opts_.daemon || opts_.enforce || opts_.autoMute
+           || opts_.pipeline)) {
+      return false;
+   }
+   if (opts_.endpointTimeoutMs != 0 && opts_.timeoutMs == 0) {
+      return false;
+   }
+   return !(opts_.daemon && opts_.remote);
 }
 
 
 static bool Init(int argc, char** argv)
 {
-   UNREFERENCED_PARAMETER(argc);
    if ((programName_ = strrchr(argv[0], '\\')) != nullptr) {
       programName_ += 1;
    } else {
       programName_ = argv[0];
    }
-   if (CoInitializeEx(0, COINIT_APARTMENTTHREADED) != S_OK) {
+   if (DisplayUsage(argc, argv) || !ParseCommandLine(argc, argv)) {
+      PrintUsage();
+      return false;
+   }
+   measure_ = opts_.timings || !opts_.tracePath.empty()
+      || !opts_.cachePath.empty();
+   if (opts_.timeoutMs != 0) {
+      deadline_ = std::chrono::steady_clock::now()
+         + std::chrono::milliseconds(opts_.timeoutMs);
+      if (opts_.endpointTimeoutMs == 0) {
+         opts_.endpointTimeoutMs = std::max(opts_.timeoutMs / 4, 1u);
+      }
+      StartWatchdog();
+   }
+   if (opts_.singleFlight) {
+      opts_.requestKey = RequestKey();
+   }
+   if (!opts_.nameCachePath.empty()) {
+      nameCache_.Open(opts_.nameCachePath);
+   }
+   if (opts_.fadeMs != 0) {
+      BuildFadeCurve();
+   }
+   SelectLevelKernels();
+   if (opts_.flushThreshold != 0) {
+      output_.SetThreshold(opts_.flushThreshold);
+      errorOutput_.SetThreshold(opts_.flushThreshold);
+   }
+   StartTraceThread();
+
+   /* MTA, so the device collection can be shared with the worker threads */
+   PhaseSpan span(Phase::ComInit);
+   if (CoInitializeEx(0, COINIT_MULTITHREADED) != S_OK) {
       PrintError(L"Failed to initialize COM library");
       return false;
    }
@@ -292,19 +5302,46 @@ static bool Init(int argc, char** argv)
 
 static void Shutdown()
 {
+   nameCache_.Close();
    CoUninitialize();
+   if (!opts_.tracePath.empty()) {
+      WriteTrace();
+   }
+   if (opts_.timings) {
+      PrintTimings();
+   }
+}
+
+static bool Run()
+{
+   if (opts_.daemon) {
+      return RunDaemon();
+   } else if (opts_.remote) {
+      return RunRemote();
+   } else if (opts_.enforce) {
+      return RunEnforce();
+   } else if (opts_.autoMute) {
+      return RunAutoMute();
+   } else if (opts_.singleFlight) {
+      return RunSingleFlight();
+   }
+   std::vector<Endpoint> endpoints;
+   return Mute(endpoints);
 }
 
 int main(int argc, char** argv)
 {
    int rc = EXIT_FAILURE;
+   startTicks_ = Now();
    if (Init(argc, argv)) {
-      if (DisplayUsage(argc, argv) || !ParseCommandLine(argc, argv)) {
-         PrintUsage();
-      } else if (Mute()) {
+      if (Run()) {
          rc = EXIT_SUCCESS;
       }
+      /* -timeout bounds the run, not writing out what it measured */
+      StopWatchdog();
       Shutdown();
    }
+   StopWatchdog();
+   FlushOutput();
    return rc;
 }
@@ -0,0 +1,1911 @@
+/*
+ Mute
+           Copyright (c) 2022, Alexander Steinhoefer
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * Neither the name of the author nor the names of its contributors may
+      be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+/* Runs the tool against a fake audio backend. The fake endpoints can be slow,
+ * hang or fail, come and go, carry application sessions and tell about
+ * changes like a real endpoint, which is enough to drive every mode without
+ * any real hardware. Exits with EXIT_FAILURE if a check fails.
+ *
+ * Everything in mute.cpp is static, so it is compiled right into the tests. */
+#define main MuteMain
+#include "../mute.cpp"
+#undef main
+
+/* =============================================================================
+ *  Fake Backend
+ */
+
+/* A session of an application on a fake endpoint */
+struct FakeApp {
+   DWORD pid;
+   BOOL muted;
+};
+
+/* What a fake endpoint does and what was done to it */
+struct FakeEndpoint {
+   std::wstring id;
+   std::wstring name;
+   EDataFlow flow = eRender;
+   std::atomic<DWORD> state = DEVICE_STATE_ACTIVE;
+   std::atomic<BOOL> muted = FALSE;
+   std::atomic<float> level = 0.5f;
+   std::atomic<float> lowestLevel = 1.0f;
+   DWORD delayMs = 0;           /* spent in every GetMute */
+   bool hang = false;           /* GetMute never returns */
+   int levelFailsAfter = -1;    /* level writes that succeed, -1 for all */
+   std::atomic<int> levelWrites = 0;
+   std::atomic<int> muteReads = 0;
+   std::atomic<int> propertyStores = 0;
+   std::vector<FakeApp> apps;
+   /* Told about every change of the mute state, like a real endpoint */
+   std::atomic<IAudioEndpointVolumeCallback*> callback = nullptr;
+};
+
+static std::vector<std::unique_ptr<FakeEndpoint>> fakeEndpoints_;
+static size_t fakeDefault_ = 0;
+static std::atomic<int> fakeEnumerations_ = 0;
+static std::atomic<IMMNotificationClient*> fakeClient_ = nullptr;
+static std::atomic<int> fakeCalls_ = 0;
+static std::atomic<int> fakePeakCalls_ = 0;
+static bool reportMutes_ = false;
+static std::mutex reportLock_;
+static std::vector<std::wstring> muteOrder_;   /* guarded by reportLock_ */
+
+/* Reference counting and QueryInterface for a fake of one interface */
+template <typename Interface>
+class Fake : public Interface {
+public:
+   virtual ~Fake() = default;
+
+   ULONG STDMETHODCALLTYPE AddRef() override
+   {
+      return ++refs_;
+   }
+
+   ULONG STDMETHODCALLTYPE Release() override
+   {
+      const ULONG refs = --refs_;
+      if (refs == 0) {
+         delete this;
+      }
+      return refs;
+   }
+
+   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** object) override
+   {
+      if (iid == __uuidof(IUnknown) || iid == __uuidof(Interface)) {
+         *object = static_cast<Interface*>(this);
+         AddRef();
+         return S_OK;
+      }
+      *object = nullptr;
+      return E_NOINTERFACE;
+   }
+
+private:
+   std::atomic<ULONG> refs_ = 1;
+};
+
+class FakeVolume : public Fake<IAudioEndpointVolume> {
+public:
+   explicit FakeVolume(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE GetMute(BOOL* muted) override
+   {
+      ++ep_.muteReads;
+      const int calls = ++fakeCalls_;
+      int peak = fakePeakCalls_;
+      while (calls > peak
+             && !fakePeakCalls_.compare_exchange_weak(peak, calls)) {
+      }
+      if (ep_.hang) {
+         Sleep(INFINITE);
+      }
+      Sleep(ep_.delayMs);
+      --fakeCalls_;
+      *muted = ep_.muted;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetMute(BOOL muted, LPCGUID context) override
+   {
+      ep_.muted = muted;
+      if (muted) {
+         std::lock_guard<std::mutex> guard(reportLock_);
+         muteOrder_.push_back(ep_.id);
+         /* Seen by the parent even if the process is terminated right
+          * after */
+         if (reportMutes_) {
+            std::printf("muted %ls\n", ep_.id.c_str());
+            std::fflush(stdout);
+         }
+      }
+      IAudioEndpointVolumeCallback* callback = ep_.callback;
+      if (callback != nullptr) {
+         AUDIO_VOLUME_NOTIFICATION_DATA data = {};
+         data.guidEventContext = (context != nullptr) ? *context : GUID();
+         data.bMuted = muted;
+         data.fMasterVolume = ep_.level;
+         data.nChannels = 1;
+         data.afChannelVolumes[0] = ep_.level;
+         callback->OnNotify(&data);
+      }
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetMasterVolumeLevelScalar(float* level) override
+   {
+      *level = ep_.level;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetMasterVolumeLevelScalar(
+      float level,
+      LPCGUID) override
+   {
+      const int writes = ep_.levelWrites++;
+      if (ep_.levelFailsAfter >= 0 && writes >= ep_.levelFailsAfter) {
+         return E_FAIL;
+      }
+      ep_.level = level;
+      if (level < ep_.lowestLevel) {
+         ep_.lowestLevel = level;
+      }
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE RegisterControlChangeNotify(
+      IAudioEndpointVolumeCallback* callback) override
+   {
+      ep_.callback = callback;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE UnregisterControlChangeNotify(
+      IAudioEndpointVolumeCallback* callback) override
+   {
+      IAudioEndpointVolumeCallback* expected = callback;
+      ep_.callback.compare_exchange_strong(expected, nullptr);
+      return S_OK;
+   }
+
+   /* Neither channels nor dB levels are faked */
+   HRESULT STDMETHODCALLTYPE GetChannelCount(UINT*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetMasterVolumeLevel(float, LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetMasterVolumeLevel(float*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetChannelVolumeLevel(
+      UINT,
+      float,
+      LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetChannelVolumeLevelScalar(
+      UINT,
+      float,
+      LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetChannelVolumeLevel(UINT, float*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetChannelVolumeLevelScalar(
+      UINT,
+      float*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetVolumeStepInfo(UINT*, UINT*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE VolumeStepUp(LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE VolumeStepDown(LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE QueryHardwareSupport(DWORD*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetVolumeRange(float*, float*, float*) override
+   {
+      return E_NOTIMPL;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+static LPWSTR CoTaskString(const std::wstring& str)
+{
+   const size_t size = (str.size() + 1) * sizeof(wchar_t);
+   LPWSTR copy = static_cast<LPWSTR>(CoTaskMemAlloc(size));
+   if (copy != nullptr) {
+      memcpy(copy, str.c_str(), size);
+   }
+   return copy;
+}
+
+/* Knows only the friendly name, every other property is empty */
+class FakePropertyStore : public Fake<IPropertyStore> {
+public:
+   explicit FakePropertyStore(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE GetValue(
+      REFPROPERTYKEY key,
+      PROPVARIANT* value) override
+   {
+      PropVariantInit(value);
+      if (key.fmtid == PKEY_Device_FriendlyName.fmtid
+          && key.pid == PKEY_Device_FriendlyName.pid) {
+         value->pwszVal = CoTaskString(ep_.name);
+         if (value->pwszVal == nullptr) {
+            return E_OUTOFMEMORY;
+         }
+         value->vt = VT_LPWSTR;
+      }
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetCount(DWORD* count) override
+   {
+      *count = 0;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetAt(DWORD, PROPERTYKEY*) override
+   {
+      return E_INVALIDARG;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetValue(
+      REFPROPERTYKEY,
+      REFPROPVARIANT) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE Commit() override
+   {
+      return E_NOTIMPL;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+class FakeFlow : public Fake<IMMEndpoint> {
+public:
+   explicit FakeFlow(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE GetDataFlow(EDataFlow* flow) override
+   {
+      *flow = ep_.flow;
+      return S_OK;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+class FakeSessionVolume : public Fake<ISimpleAudioVolume> {
+public:
+   explicit FakeSessionVolume(FakeApp& app) : app_(app) {}
+
+   HRESULT STDMETHODCALLTYPE GetMute(BOOL* muted) override
+   {
+      *muted = app_.muted;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetMute(BOOL muted, LPCGUID) override
+   {
+      app_.muted = muted;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetMasterVolume(float, LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetMasterVolume(float*) override
+   {
+      return E_NOTIMPL;
+   }
+
+private:
+   FakeApp& app_;
+};
+
+/* Knows only its process and its volume */
+class FakeSession : public Fake<IAudioSessionControl2> {
+public:
+   explicit FakeSession(FakeApp& app) : app_(app) {}
+
+   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** object) override
+   {
+      if (iid == __uuidof(IAudioSessionControl)) {
+         *object = static_cast<IAudioSessionControl*>(this);
+         AddRef();
+         return S_OK;
+      }
+      if (iid == __uuidof(ISimpleAudioVolume)) {
+         *object = static_cast<ISimpleAudioVolume*>(
+            new FakeSessionVolume(app_));
+         return S_OK;
+      }
+      return Fake<IAudioSessionControl2>::QueryInterface(iid, object);
+   }
+
+   HRESULT STDMETHODCALLTYPE GetProcessId(DWORD* pid) override
+   {
+      *pid = app_.pid;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE IsSystemSoundsSession() override
+   {
+      return S_FALSE;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetState(AudioSessionState*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetDisplayName(LPWSTR*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetDisplayName(LPCWSTR, LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetIconPath(LPWSTR*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetIconPath(LPCWSTR, LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetGroupingParam(GUID*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetGroupingParam(LPCGUID, LPCGUID) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE RegisterAudioSessionNotification(
+      IAudioSessionEvents*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE UnregisterAudioSessionNotification(
+      IAudioSessionEvents*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetSessionIdentifier(LPWSTR*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetSessionInstanceIdentifier(LPWSTR*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE SetDuckingPreference(BOOL) override
+   {
+      return E_NOTIMPL;
+   }
+
+private:
+   FakeApp& app_;
+};
+
+class FakeSessionEnumerator : public Fake<IAudioSessionEnumerator> {
+public:
+   explicit FakeSessionEnumerator(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE GetCount(int* count) override
+   {
+      *count = static_cast<int>(ep_.apps.size());
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetSession(
+      int index,
+      IAudioSessionControl** session) override
+   {
+      if (index < 0 || static_cast<size_t>(index) >= ep_.apps.size()) {
+         *session = nullptr;
+         return E_INVALIDARG;
+      }
+      *session = new FakeSession(ep_.apps[index]);
+      return S_OK;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+/* Only enumerates, there are no notifications and no ducking */
+class FakeSessionManager : public Fake<IAudioSessionManager2> {
+public:
+   explicit FakeSessionManager(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE GetSessionEnumerator(
+      IAudioSessionEnumerator** sessionEnumerator) override
+   {
+      *sessionEnumerator = new FakeSessionEnumerator(ep_);
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetAudioSessionControl(
+      LPCGUID,
+      DWORD,
+      IAudioSessionControl**) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetSimpleAudioVolume(
+      LPCGUID,
+      DWORD,
+      ISimpleAudioVolume**) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE RegisterSessionNotification(
+      IAudioSessionNotification*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE UnregisterSessionNotification(
+      IAudioSessionNotification*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE RegisterDuckNotification(
+      LPCWSTR,
+      IAudioVolumeDuckNotification*) override
+   {
+      return E_NOTIMPL;
+   }
+
+   HRESULT STDMETHODCALLTYPE UnregisterDuckNotification(
+      IAudioVolumeDuckNotification*) override
+   {
+      return E_NOTIMPL;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+class FakeDevice : public Fake<IMMDevice> {
+public:
+   explicit FakeDevice(FakeEndpoint& ep) : ep_(ep) {}
+
+   HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** object) override
+   {
+      if (iid == __uuidof(IMMEndpoint)) {
+         *object = static_cast<IMMEndpoint*>(new FakeFlow(ep_));
+         return S_OK;
+      }
+      return Fake<IMMDevice>::QueryInterface(iid, object);
+   }
+
+   HRESULT STDMETHODCALLTYPE Activate(
+      REFIID iid,
+      DWORD,
+      PROPVARIANT*,
+      void** object) override
+   {
+      if (iid == __uuidof(IAudioEndpointVolume)) {
+         *object = static_cast<IAudioEndpointVolume*>(new FakeVolume(ep_));
+         return S_OK;
+      }
+      if (iid == __uuidof(IAudioSessionManager2)) {
+         *object = static_cast<IAudioSessionManager2*>(
+            new FakeSessionManager(ep_));
+         return S_OK;
+      }
+      *object = nullptr;
+      return E_NOINTERFACE;
+   }
+
+   HRESULT STDMETHODCALLTYPE OpenPropertyStore(
+      DWORD,
+      IPropertyStore** propStore) override
+   {
+      ++ep_.propertyStores;
+      *propStore = new FakePropertyStore(ep_);
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetId(LPWSTR* id) override
+   {
+      *id = CoTaskString(ep_.id);
+      return (*id != nullptr) ? S_OK : E_OUTOFMEMORY;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetState(DWORD* state) override
+   {
+      *state = ep_.state;
+      return S_OK;
+   }
+
+private:
+   FakeEndpoint& ep_;
+};
+
+/* Holds the endpoints that matched when it was made, like the real one */
+class FakeCollection : public Fake<IMMDeviceCollection> {
+public:
+   FakeCollection(EDataFlow flow, DWORD stateMask)
+   {
+      for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+         if ((flow == eAll || ep->flow == flow)
+             && (ep->state & stateMask) != 0) {
+            endpoints_.push_back(ep.get());
+         }
+      }
+   }
+
+   HRESULT STDMETHODCALLTYPE GetCount(UINT* count) override
+   {
+      *count = static_cast<UINT>(endpoints_.size());
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE Item(UINT index, IMMDevice** device) override
+   {
+      if (index >= endpoints_.size()) {
+         *device = nullptr;
+         return E_INVALIDARG;
+      }
+      *device = new FakeDevice(*endpoints_[index]);
+      return S_OK;
+   }
+
+private:
+   std::vector<FakeEndpoint*> endpoints_;
+};
+
+/* The default render endpoint is the one at fakeDefault_, the default
+ * capture endpoint the first active one */
+class FakeEnumerator : public Fake<IMMDeviceEnumerator> {
+public:
+   HRESULT STDMETHODCALLTYPE EnumAudioEndpoints(
+      EDataFlow flow,
+      DWORD stateMask,
+      IMMDeviceCollection** devices) override
+   {
+      ++fakeEnumerations_;
+      *devices = new FakeCollection(flow, stateMask);
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetDefaultAudioEndpoint(
+      EDataFlow flow,
+      ERole,
+      IMMDevice** device) override
+   {
+      for (size_t i = 0; i < fakeEndpoints_.size(); ++i) {
+         FakeEndpoint& ep = *fakeEndpoints_[i];
+         if (ep.flow == flow && ep.state == DEVICE_STATE_ACTIVE
+             && (flow != eRender || i == fakeDefault_)) {
+            *device = new FakeDevice(ep);
+            return S_OK;
+         }
+      }
+      *device = nullptr;
+      return E_NOTFOUND;
+   }
+
+   HRESULT STDMETHODCALLTYPE GetDevice(LPCWSTR id, IMMDevice** device) override
+   {
+      for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+         if (ep->id == id) {
+            *device = new FakeDevice(*ep);
+            return S_OK;
+         }
+      }
+      *device = nullptr;
+      return E_NOTFOUND;
+   }
+
+   /* The tests deliver the notifications themselves */
+   HRESULT STDMETHODCALLTYPE RegisterEndpointNotificationCallback(
+      IMMNotificationClient* client) override
+   {
+      fakeClient_ = client;
+      return S_OK;
+   }
+
+   HRESULT STDMETHODCALLTYPE UnregisterEndpointNotificationCallback(
+      IMMNotificationClient* client) override
+   {
+      IMMNotificationClient* expected = client;
+      fakeClient_.compare_exchange_strong(expected, nullptr);
+      return S_OK;
+   }
+};
+
+static HRESULT CreateFakeEnumerator(IMMDeviceEnumeratorPtr& deviceEnumerator)
+{
+   deviceEnumerator.Attach(new FakeEnumerator());
+   return S_OK;
+}
+
+/* =============================================================================
+ *  Harness
+ */
+
+static int failures_ = 0;
+
+#define CHECK(expr) Check((expr), #expr, __LINE__)
+
+static void Check(bool ok, const char* expr, int line)
+{
+   if (!ok) {
+      std::fprintf(
+         stderr, "mute_tests.cpp(%d): CHECK(%s) failed\n", line, expr);
+      ++failures_;
+   }
+}
+
+/* Forgets everything earlier runs left behind and sets the options of a
+ * plain, silent run */
+static void ResetOptions()
+{
+   opts_ = Options();
+   opts_.silent = true;
+   filter_ = DeviceFilter();
+   measure_ = false;
+   capture_ = nullptr;
+   defaultEndpointId_.clear();
+   groupMuted_ = false;
+   processNames_.clear();
+   activationStats_.activated = 0;
+   activationStats_.avoided = 0;
+   runTimes_ = PhaseTimes();
+   firstSilenceTicks_ = 0;
+   fades_.clear();
+   fadeCurve_.clear();
+   fadeStats_ = FadeStats();
+   enforceStats_ = EnforceStats();
+   arrivalLatency_ = LatencyHistogram();
+   endpointTimes_.clear();
+}
+
+static FakeEndpoint& AddFake()
+{
+   const std::wstring number = std::to_wstring(fakeEndpoints_.size());
+   fakeEndpoints_.push_back(std::make_unique<FakeEndpoint>());
+   fakeEndpoints_.back()->id = L"fake-" + number;
+   fakeEndpoints_.back()->name = L"Fake " + number;
+   return *fakeEndpoints_.back();
+}
+
+/* Starts over with the given number of unmuted, active render endpoints, of
+ * which the first one is the default */
+static void Reset(size_t count)
+{
+   ResetOptions();
+   fakeEndpoints_.clear();
+   fakeDefault_ = 0;
+   fakeEnumerations_ = 0;
+   fakeCalls_ = 0;
+   fakePeakCalls_ = 0;
+   muteOrder_.clear();
+   for (size_t i = 0; i < count; ++i) {
+      AddFake();
+   }
+}
+
+static void SetFade(unsigned ms)
+{
+   opts_.fadeMs = ms;
+   BuildFadeCurve();
+}
+
+static bool AllMuted()
+{
+   return std::all_of(fakeEndpoints_.begin(), fakeEndpoints_.end(),
+      [](const std::unique_ptr<FakeEndpoint>& ep) { return !!ep->muted; });
+}
+
+static bool NoneMuted()
+{
+   return std::none_of(fakeEndpoints_.begin(), fakeEndpoints_.end(),
+      [](const std::unique_ptr<FakeEndpoint>& ep) { return !!ep->muted; });
+}
+
+/* Checks that every endpoint was muted by this run */
+static void CheckChanged(const std::vector<Endpoint>& endpoints)
+{
+   CHECK(endpoints.size() == fakeEndpoints_.size());
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      CHECK(endpoints[i].index == i);
+      CHECK(endpoints[i].status == EndpointStatus::Changed);
+      CHECK(endpoints[i].muted);
+   }
+   CHECK(AllMuted());
+}
+
+/* For what another thread does, gives up after two seconds */
+template <typename Condition>
+static bool WaitFor(Condition condition)
+{
+   for (int i = 0; i < 2000; ++i) {
+      if (condition()) {
+         return true;
+      }
+      Sleep(1);
+   }
+   return condition();
+}
+
+static bool Parse(std::initializer_list<const char*> args)
+{
+   std::vector<std::string> strings = { "mute" };
+   strings.insert(strings.end(), args.begin(), args.end());
+   std::vector<char*> argv;
+   for (std::string& arg : strings) {
+      argv.push_back(arg.data());
+   }
+   return ParseCommandLine(static_cast<int>(argv.size()), argv.data());
+}
+
+static std::string TempPath(const char* name)
+{
+   char dir[MAX_PATH];
+   const DWORD length = GetTempPathA(MAX_PATH, dir);
+   return std::string(dir, (length < MAX_PATH) ? length : 0) + "mute_tests."
+      + std::to_string(GetCurrentProcessId()) + "." + name;
+}
+
+static void RemoveFile(const std::string& path)
+{
+   DeleteFileA(path.c_str());
+}
+
+static std::string ReadText(const std::string& path)
+{
+   std::string text;
+   FILE* file = nullptr;
+   if (fopen_s(&file, path.c_str(), "rb") != 0 || file == nullptr) {
+      return text;
+   }
+   char chunk[4096];
+   size_t read;
+   while ((read = fread(chunk, 1, sizeof chunk, file)) != 0) {
+      text.append(chunk, read);
+   }
+   fclose(file);
+   return text;
+}
+
+static size_t CountOf(const std::string& text, const char* part)
+{
+   size_t count = 0;
+   for (size_t pos = text.find(part); pos != std::string::npos;
+        pos = text.find(part, pos + 1)) {
+      ++count;
+   }
+   return count;
+}
+
+/* =============================================================================
+ *  Tests
+ */
+
+static void TestSerial()
+{
+   Reset(3);
+   fakeEndpoints_[1]->muted = TRUE;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints.size() == 3);
+   CHECK(endpoints[0].status == EndpointStatus::Changed);
+   CHECK(endpoints[1].status == EndpointStatus::Unchanged);
+   CHECK(endpoints[2].status == EndpointStatus::Changed);
+   CHECK(AllMuted());
+}
+
+static void TestJobs()
+{
+   Reset(8);
+   opts_.jobs = 4;
+   for (std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      ep->delayMs = 20;
+   }
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CheckChanged(endpoints);
+   CHECK(fakePeakCalls_ > 1);
+   CHECK(fakePeakCalls_ <= 4);
+}
+
+/* The first endpoints are the slowest, still they are reported first */
+static void TestJobsReportInOrder()
+{
+   Reset(4);
+   opts_.silent = false;
+   opts_.jobs = 4;
+   for (size_t i = 0; i < fakeEndpoints_.size(); ++i) {
+      fakeEndpoints_[i]->delayMs = static_cast<DWORD>(60 - 20 * i);
+   }
+   std::wstring report;
+   capture_ = &report;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   capture_ = nullptr;
+   CheckChanged(endpoints);
+   size_t last = 0;
+   for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      const size_t pos = report.find(L"> " + ep->name + L" is now muted");
+      CHECK(pos != std::wstring::npos);
+      CHECK(pos >= last);
+      last = (pos != std::wstring::npos) ? pos : last;
+   }
+}
+
+static void TestPipeline()
+{
+   Reset(12);
+   opts_.pipeline = true;
+   fakeEndpoints_[3]->muted = TRUE;
+   fakeEndpoints_[7]->delayMs = 30;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints.size() == 12);
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      CHECK(endpoints[i].index == i);
+      CHECK(endpoints[i].status == ((i == 3) ? EndpointStatus::Unchanged
+                                             : EndpointStatus::Changed));
+   }
+   CHECK(AllMuted());
+}
+
+/* Requests are served with the interfaces activated when the daemon
+ * started, only an endpoint whose state changed in between gets new ones */
+static void TestDaemon()
+{
+   Reset(3);
+   opts_.daemon = true;
+   IMMDeviceEnumeratorPtr deviceEnumerator;
+   CreateFakeEnumerator(deviceEnumerator);
+   DeviceTable table;
+   CHECK(table.Open(deviceEnumerator));
+   std::vector<Endpoint> endpoints;
+   ULONGLONG generation = SyncEndpoints(table, deviceEnumerator, endpoints);
+   for (Endpoint& ep : endpoints) {
+      IAudioEndpointVolumePtr endpointVolume;
+      if (ResolveEndpoint(nullptr, ep)) {
+         ep.handle.Volume(endpointVolume);
+      }
+   }
+   const ULONG activated = activationStats_.activated;
+
+   DaemonRequest request = {
+      daemonProtocolVersion_, static_cast<DWORD>(Action::Mute)
+   };
+   std::wstring report;
+   CHECK(HandleDaemonRequest(
+      table, deviceEnumerator, endpoints, generation, request, report));
+   CHECK(AllMuted());
+   CHECK(report.find(L"> Fake 1 is now muted") != std::wstring::npos);
+   CHECK(activationStats_.activated == activated);
+
+   fakeEndpoints_[1]->state = DEVICE_STATE_UNPLUGGED;
+   table.OnDeviceStateChanged(L"fake-1", DEVICE_STATE_UNPLUGGED);
+   fakeEndpoints_[1]->state = DEVICE_STATE_ACTIVE;
+   table.OnDeviceStateChanged(L"fake-1", DEVICE_STATE_ACTIVE);
+   request.action = static_cast<DWORD>(Action::Unmute);
+   report.clear();
+   CHECK(HandleDaemonRequest(
+      table, deviceEnumerator, endpoints, generation, request, report));
+   CHECK(NoneMuted());
+   CHECK(endpoints.size() == 3);
+   CHECK(activationStats_.activated == activated + 1);
+   CHECK(fakeEnumerations_ == 1);
+
+   request.version = daemonProtocolVersion_ + 1;
+   report.clear();
+   CHECK(!HandleDaemonRequest(
+      table, deviceEnumerator, endpoints, generation, request, report));
+   CHECK(report.find(L"Unsupported request") != std::wstring::npos);
+   table.Close();
+
+   /* The daemon decides which endpoints there are and how they are shown */
+   ResetOptions();
+   CHECK(Parse({ "-remote", "-unmute" }));
+   ResetOptions();
+   CHECK(!Parse({ "-remote", "-json" }));
+   ResetOptions();
+   CHECK(!Parse({ "-remote", "-id", "fake-0" }));
+   ResetOptions();
+   CHECK(!Parse({ "-remote", "-include", "name:*" }));
+   ResetOptions();
+}
+
+static const DeviceInfo* FindDevice(
+   const std::vector<DeviceInfo>& devices,
+   const wchar_t* id)
+{
+   for (const DeviceInfo& info : devices) {
+      if (info.id == id) {
+         return &info;
+      }
+   }
+   return nullptr;
+}
+
+/* A burst of notifications is folded into the table, and the endpoints
+ * synced with it keep what is still valid */
+static void TestDeviceTable()
+{
+   Reset(4);
+   fakeEndpoints_[3]->state = DEVICE_STATE_NOTPRESENT;
+   IMMDeviceEnumeratorPtr deviceEnumerator;
+   CreateFakeEnumerator(deviceEnumerator);
+   DeviceTable table;
+   CHECK(table.Open(deviceEnumerator));
+   CHECK(fakeClient_ == &table);
+   std::vector<Endpoint> endpoints;
+   const ULONGLONG seeded = SyncEndpoints(table, deviceEnumerator, endpoints);
+   CHECK(endpoints.size() == 3);
+   if (endpoints.size() != 3) {
+      table.Close();
+      return;
+   }
+   endpoints[0].name = L"Fake 0";
+   const IMMDevice* kept = endpoints[0].handle.Device().GetInterfacePtr();
+   const IMMDevice* replugged = endpoints[1].handle.Device().GetInterfacePtr();
+
+   fakeEndpoints_[3]->state = DEVICE_STATE_ACTIVE;
+   table.OnDeviceAdded(L"fake-3");
+   table.OnDeviceStateChanged(L"fake-3", DEVICE_STATE_ACTIVE);
+   table.OnDeviceStateChanged(L"fake-1", DEVICE_STATE_UNPLUGGED);
+   table.OnDeviceStateChanged(L"fake-1", DEVICE_STATE_ACTIVE);
+   fakeEndpoints_[2]->state = DEVICE_STATE_NOTPRESENT;
+   table.OnDeviceRemoved(L"fake-2");
+   table.OnPropertyValueChanged(L"fake-0", PKEY_Device_FriendlyName);
+   table.OnDefaultDeviceChanged(eRender, eConsole, L"fake-3");
+   CHECK(table.Generation() > seeded);
+
+   const ULONGLONG generation =
+      SyncEndpoints(table, deviceEnumerator, endpoints);
+   CHECK(generation == table.Generation());
+   CHECK(endpoints.size() == 3);
+   if (endpoints.size() == 3) {
+      CHECK(endpoints[0].id == L"fake-0");
+      CHECK(endpoints[0].name.empty());
+      CHECK(endpoints[0].handle.Device().GetInterfacePtr() == kept);
+      CHECK(endpoints[1].id == L"fake-1");
+      CHECK(endpoints[1].handle.Device().GetInterfacePtr() != replugged);
+      CHECK(endpoints[2].id == L"fake-3");
+      CHECK(endpoints[2].index == 2);
+   }
+
+   /* The sync took the flags, the rest stays */
+   std::vector<DeviceInfo> devices;
+   CHECK(table.Snapshot(devices) == generation);
+   for (const DeviceInfo& info : devices) {
+      CHECK(!info.renamed && !info.stateChanged);
+   }
+   const DeviceInfo* added = FindDevice(devices, L"fake-3");
+   const DeviceInfo* removed = FindDevice(devices, L"fake-2");
+   const DeviceInfo* previous = FindDevice(devices, L"fake-0");
+   CHECK(added != nullptr && added->state == DEVICE_STATE_ACTIVE
+         && added->flow == eRender && added->isDefault);
+   CHECK(removed != nullptr && removed->state == DEVICE_STATE_NOTPRESENT);
+   CHECK(previous != nullptr && !previous->isDefault);
+
+   table.OnPropertyValueChanged(L"fake-3", PKEY_Device_FriendlyName);
+   CHECK(table.Snapshot(devices) > generation);
+   added = FindDevice(devices, L"fake-3");
+   CHECK(added != nullptr && added->renamed);
+   table.Snapshot(devices);
+   added = FindDevice(devices, L"fake-3");
+   CHECK(added != nullptr && !added->renamed);
+   table.Close();
+   CHECK(fakeClient_ == nullptr);
+   CHECK(fakeEnumerations_ == 1);
+}
+
+/* A plain mute needs neither the property store nor the sessions */
+static void TestLazyActivation()
+{
+   Reset(3);
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CheckChanged(endpoints);
+   CHECK(activationStats_.activated == 3);
+   CHECK(activationStats_.avoided == 6);
+   for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      CHECK(ep->propertyStores == 0);
+   }
+}
+
+static void TestTimings()
+{
+   Reset(3);
+   opts_.timings = true;
+   measure_ = true;
+   startTicks_ = Now();
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpointTimes_.size() == 3);
+   for (const EndpointTimes& times : endpointTimes_) {
+      CHECK(times.times.calls[static_cast<int>(Phase::Activate)] == 1);
+      CHECK(times.times.calls[static_cast<int>(Phase::GetMute)] == 1);
+      CHECK(times.times.calls[static_cast<int>(Phase::SetMute)] == 1);
+   }
+   CHECK(runTimes_.calls[static_cast<int>(Phase::Enumerate)] == 1);
+
+   std::wstring report;
+   capture_ = &report;
+   PrintTimings();
+   capture_ = nullptr;
+   CHECK(report.find(L"GetMute") != std::wstring::npos);
+   CHECK(report.find(L"First silence") != std::wstring::npos);
+   CHECK(report.find(L"3 performed, 6 avoided") != std::wstring::npos);
+}
+
+static void TestTrace()
+{
+   Reset(2);
+   opts_.tracePath = TempPath("trace.json");
+   measure_ = true;
+   startTicks_ = Now();
+   StartTraceThread();
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   WriteTrace();
+   const std::string trace = ReadText(opts_.tracePath);
+   RemoveFile(opts_.tracePath);
+   CHECK(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[")
+         == 0);
+   CHECK(CountOf(trace, "\"name\":\"GetMute\"") == 2);
+   CHECK(CountOf(trace, "\"name\":\"Enumerate\"") >= 1);
+   CHECK(CountOf(trace, "\"endpoint\":\"#1\"") >= 3);
+   CHECK(trace.find("\n]}\n") == trace.size() - 4);
+}
+
+static void WriteLine(OutputWriter& writer, const wchar_t* fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   writer.Line(L"> ", fmt, ap);
+   va_end(ap);
+}
+
+/* Lines written by several threads at once come out whole and, per
+ * thread, in order, also across many flushes */
+static void TestOutputWriter()
+{
+   FILE* file = std::tmpfile();
+   CHECK(file != nullptr);
+   if (file == nullptr) {
+      return;
+   }
+   const int threadCount = 4;
+   const int lineCount = 2000;
+   {
+      OutputWriter writer(file);
+      std::vector<std::thread> threads;
+      for (int t = 0; t < threadCount; ++t) {
+         threads.emplace_back([&writer, t] {
+            for (int i = 0; i < lineCount; ++i) {
+               WriteLine(writer, L"thread %d line %d", t, i);
+            }
+         });
+      }
+      for (std::thread& thread : threads) {
+         thread.join();
+      }
+      writer.Flush();
+   }
+
+   std::rewind(file);
+   std::vector<long> next(threadCount, 0);
+   int lines = 0;
+   bool whole = true;
+   char line[64];
+   while (fgets(line, sizeof line, file) != nullptr) {
+      ++lines;
+      char* end = line + 9;
+      const long t = (strncmp(line, "> thread ", 9) == 0)
+         ? strtol(line + 9, &end, 10) : -1;
+      if (t < 0 || t >= threadCount || strncmp(end, " line ", 6) != 0
+          || strtol(end + 6, &end, 10) != next[t] || strcmp(end, "\n") != 0) {
+         whole = false;
+         continue;
+      }
+      ++next[t];
+   }
+   fclose(file);
+   CHECK(whole);
+   CHECK(lines == threadCount * lineCount);
+}
+
+static void TestJson()
+{
+   std::wstring out;
+   AppendJsonString(out, L"say \"hi\"\\\n\u00e9");
+   CHECK(out == L"\"say \\\"hi\\\"\\\\\\u000a\\u00e9\"");
+   CHECK(JsonEscape(L"a\tb") == L"a\\u0009b");
+
+   out.clear();
+   {
+      JsonRecord record(out);
+      record.String(L"id", L"fake-0");
+      record.Number(L"us", 42);
+      record.Literal(L"state", MuteStateName(TRUE));
+   }
+   CHECK(out == L"{\"id\":\"fake-0\",\"us\":42,\"state\":\"muted\"}\n");
+}
+
+static void TestCapture()
+{
+   Reset(4);
+   fakeEndpoints_[2]->flow = eCapture;
+   fakeEndpoints_[3]->flow = eCapture;
+   opts_.flow = eCapture;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints.size() == 2);
+   for (const Endpoint& ep : endpoints) {
+      CHECK(ep.flow == eCapture);
+      CHECK(ep.status == EndpointStatus::Changed);
+   }
+   CHECK(!fakeEndpoints_[0]->muted && !fakeEndpoints_[1]->muted);
+   CHECK(fakeEndpoints_[2]->muted && fakeEndpoints_[3]->muted);
+
+   /* Both directions from a single enumeration */
+   for (std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      ep->muted = FALSE;
+   }
+   ResetOptions();
+   fakeEnumerations_ = 0;
+   opts_.flow = eAll;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints.size() == 4);
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      CHECK(endpoints[i].flow == fakeEndpoints_[i]->flow);
+   }
+   CHECK(AllMuted());
+   CHECK(fakeEnumerations_ == 1);
+}
+
+/* The default endpoint is silent before the others are even enumerated,
+ * and is reported last without being muted twice */
+static void TestDefaultFirst()
+{
+   Reset(3);
+   fakeDefault_ = 2;
+   opts_.defaultFirst = true;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(AllMuted());
+   CHECK(muteOrder_.size() == 3);
+   CHECK(!muteOrder_.empty() && muteOrder_.front() == L"fake-2");
+   CHECK(endpoints.size() == 4);
+   if (endpoints.size() == 4) {
+      CHECK(endpoints[2].status == EndpointStatus::Skipped);
+      CHECK(endpoints[3].index == 3);
+      CHECK(endpoints[3].id == L"fake-2");
+      CHECK(endpoints[3].status == EndpointStatus::Changed);
+   }
+}
+
+static void TestIds()
+{
+   Reset(3);
+   opts_.ids = { L"fake-2", L"fake-9" };
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(fakeEnumerations_ == 0);
+   CHECK(endpoints.size() == 2);
+   if (endpoints.size() == 2) {
+      CHECK(endpoints[0].status == EndpointStatus::Changed);
+      CHECK(endpoints[1].status == EndpointStatus::NotFound);
+   }
+   CHECK(!fakeEndpoints_[0]->muted && !fakeEndpoints_[1]->muted);
+   CHECK(fakeEndpoints_[2]->muted);
+}
+
+static void TestFilter()
+{
+   const GlobPattern glob(L"fake**SPEA?ER");
+   CHECK(glob.Pattern() == L"fake*spea?er");
+   CHECK(glob.Match(L"Fake USB Speaker"));
+   CHECK(glob.Match(L"fakespeaker"));
+   CHECK(!glob.Match(L"Fake Speakers"));
+   CHECK(!glob.Match(L"Fake Speer"));
+   CHECK(GlobPattern(L"*").Match(L""));
+
+   DeviceFilter filter;
+   CHECK(filter.Add(L"name:*hdmi*", false));
+   CHECK(filter.Add(L"ID:fake-1", true));
+   CHECK(!filter.Add(L"color:red", false));
+   CHECK(!filter.Add(L"name", false));
+   CHECK(filter.Needs(FilterField::Name) && filter.Needs(FilterField::Id));
+   CHECK(!filter.Needs(FilterField::FormFactor));
+   const wchar_t* const included[] = {
+      L"HDMI Out", L"fake-0", L"render", nullptr
+   };
+   const wchar_t* const excluded[] = {
+      L"HDMI Out", L"fake-1", L"render", nullptr
+   };
+   const wchar_t* const unmatched[] = {
+      L"Speakers", L"fake-0", L"render", nullptr
+   };
+   const wchar_t* const unnamed[] = { nullptr, L"fake-0", L"render", nullptr };
+   const wchar_t* const unnamedExcluded[] = {
+      nullptr, L"fake-1", L"render", nullptr
+   };
+   CHECK(filter.Evaluate(included) == FilterResult::Included);
+   CHECK(filter.Evaluate(excluded) == FilterResult::Excluded);
+   CHECK(filter.Evaluate(unmatched) == FilterResult::Excluded);
+   CHECK(filter.Evaluate(unnamed) == FilterResult::Undecided);
+   CHECK(filter.Evaluate(unnamedExcluded) == FilterResult::Excluded);
+
+   /* Excluded by its ID, the first endpoint never opens its property
+    * store */
+   Reset(3);
+   CHECK(filter_.Add(L"id:fake-0", true));
+   CHECK(filter_.Add(L"name:fake ?", false));
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints.size() == 3);
+   if (endpoints.size() == 3) {
+      CHECK(endpoints[0].status == EndpointStatus::Filtered);
+      CHECK(endpoints[1].status == EndpointStatus::Changed);
+      CHECK(endpoints[2].status == EndpointStatus::Changed);
+   }
+   CHECK(!fakeEndpoints_[0]->muted);
+   CHECK(fakeEndpoints_[0]->propertyStores == 0);
+   CHECK(fakeEndpoints_[1]->muted && fakeEndpoints_[2]->muted);
+}
+
+/* Only the sessions of the application are muted, not the endpoints */
+static void TestApps()
+{
+   Reset(3);
+   fakeEndpoints_[0]->apps = { { 100, FALSE }, { 200, FALSE } };
+   fakeEndpoints_[1]->apps = { { 100, TRUE } };
+   opts_.apps.push_back({ 100, L"" });
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(NoneMuted());
+   CHECK(fakeEndpoints_[0]->apps[0].muted);
+   CHECK(!fakeEndpoints_[0]->apps[1].muted);
+   CHECK(endpoints.size() == 3);
+   if (endpoints.size() == 3) {
+      CHECK(endpoints[0].status == EndpointStatus::Changed);
+      CHECK(endpoints[0].sessions == 1 && endpoints[0].sessionsChanged == 1);
+      CHECK(endpoints[0].muted);
+      CHECK(endpoints[1].status == EndpointStatus::Unchanged);
+      CHECK(endpoints[2].status == EndpointStatus::NoSessions);
+   }
+
+   ResetOptions();
+   opts_.apps.push_back({ 300, L"" });
+   CHECK(!Mute(endpoints));
+}
+
+/* Muting after -save and then restoring brings back what was there, even
+ * a level someone changed in between */
+static void TestSaveRestore()
+{
+   Reset(3);
+   fakeEndpoints_[1]->muted = TRUE;
+   fakeEndpoints_[1]->level = 0.3f;
+   const std::string path = TempPath("state.bin");
+   opts_.save = true;
+   opts_.statePath = path;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(AllMuted());
+
+   fakeEndpoints_[0]->level = 0.9f;
+   AddFake().muted = TRUE;
+   ResetOptions();
+   opts_.action = Action::Restore;
+   opts_.statePath = path;
+   CHECK(Mute(endpoints));
+   RemoveFile(path);
+   CHECK(!fakeEndpoints_[0]->muted);
+   CHECK(std::fabs(fakeEndpoints_[0]->level - 0.5f) < 0.001f);
+   CHECK(fakeEndpoints_[1]->muted);
+   CHECK(std::fabs(fakeEndpoints_[1]->level - 0.3f) < 0.001f);
+   CHECK(!fakeEndpoints_[2]->muted);
+   CHECK(fakeEndpoints_[3]->muted);
+   CHECK(endpoints.size() == 4);
+   if (endpoints.size() == 4) {
+      CHECK(endpoints[0].status == EndpointStatus::Changed);
+      CHECK(endpoints[1].status == EndpointStatus::Unchanged);
+      CHECK(endpoints[3].status == EndpointStatus::NotSaved);
+   }
+
+   ResetOptions();
+   opts_.action = Action::Restore;
+   opts_.statePath = path;
+   CHECK(!Mute(endpoints));
+}
+
+static void TestToggle()
+{
+   Reset(2);
+   fakeEndpoints_[0]->muted = TRUE;
+   opts_.action = Action::Toggle;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(!fakeEndpoints_[0]->muted && fakeEndpoints_[1]->muted);
+   for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      CHECK(ep->muteReads == 1);
+   }
+
+   /* The default endpoint is not muted, so the whole group is */
+   Reset(3);
+   fakeDefault_ = 1;
+   fakeEndpoints_[0]->muted = TRUE;
+   opts_.action = Action::ToggleGroup;
+   CHECK(Mute(endpoints));
+   CHECK(AllMuted());
+}
+
+/* Muted at the end of the ramp, with the level back where it was */
+static void TestFadeOut()
+{
+   Reset(3);
+   opts_.jobs = 2;
+   SetFade(50);
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CheckChanged(endpoints);
+   for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      CHECK(ep->lowestLevel < 0.5f);
+      CHECK(ep->level == 0.5f);
+      CHECK(ep->levelWrites > 2);
+   }
+}
+
+static void TestFadeIn()
+{
+   Reset(2);
+   opts_.action = Action::Unmute;
+   SetFade(50);
+   for (std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      ep->muted = TRUE;
+   }
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      CHECK(endpoints[i].status == EndpointStatus::Changed);
+      CHECK(!fakeEndpoints_[i]->muted);
+      CHECK(fakeEndpoints_[i]->lowestLevel == 0.0f);
+      CHECK(std::fabs(fakeEndpoints_[i]->level - 0.5f) < 0.001f);
+   }
+}
+
+/* A ramp that breaks off part way still ends muted */
+static void TestFadeFailure()
+{
+   Reset(2);
+   SetFade(50);
+   fakeEndpoints_[0]->levelFailsAfter = 2;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CHECK(endpoints[0].status == EndpointStatus::SetVolumeFailed);
+   CHECK(endpoints[0].muted);
+   CHECK(endpoints[1].status == EndpointStatus::Changed);
+   CHECK(AllMuted());
+}
+
+/* Every kernel variant gives the same bits as the scalar code, for every
+ * tail length and at and beyond both ends of the clamp */
+static void TestLevelKernels()
+{
+   static const float levels[] = {
+      -1.0f, -0.0f, 0.0f, 1e-40f, 0.25f, 0.5f, 0.999999f, 1.0f, 1.5f,
+      3.0f, std::nanf("")
+   };
+   static const float gains[] = { 0.0f, 0.5f, 1.0f, 1.0001f, 2.0f };
+   static const float factors[] = { 0.0f, 0.3f, 1.0f };
+   const size_t levelCount = std::size(levels);
+
+   std::vector<LevelKernels> variants;
+#ifdef HAVE_X86_KERNELS
+   if (HasSse2()) {
+      variants.push_back({ L"sse2", ScaleLevelsSse2, LerpLevelsSse2 });
+   }
+   if (HasAvx()) {
+      variants.push_back({ L"avx", ScaleLevelsAvx, LerpLevelsAvx });
+   }
+#endif
+   const float guard = 42.0f;
+   for (size_t count = 0; count <= 17; ++count) {
+      std::vector<float> a(count);
+      std::vector<float> b(count);
+      std::vector<float> g(count);
+      for (size_t i = 0; i < count; ++i) {
+         a[i] = levels[i % levelCount];
+         b[i] = levels[(i * 7 + 3) % levelCount];
+         g[i] = gains[i % std::size(gains)];
+      }
+      /* One past the end, so data() is never null for memcmp */
+      std::vector<float> expected(count + 1);
+      ScaleLevelsScalar(a.data(), g.data(), expected.data(), count);
+      for (const LevelKernels& kernels : variants) {
+         std::vector<float> out(count + 1, guard);
+         kernels.scale(a.data(), g.data(), out.data(), count);
+         CHECK(memcmp(out.data(), expected.data(), count * sizeof(float))
+               == 0);
+         CHECK(out[count] == guard);
+      }
+      for (float t : factors) {
+         LerpLevelsScalar(a.data(), b.data(), t, expected.data(), count);
+         for (const LevelKernels& kernels : variants) {
+            std::vector<float> out(count + 1, guard);
+            kernels.lerp(a.data(), b.data(), t, out.data(), count);
+            CHECK(memcmp(out.data(), expected.data(), count * sizeof(float))
+                  == 0);
+            CHECK(out[count] == guard);
+         }
+      }
+      /* The clamp itself, whatever the variant */
+      for (float level : expected) {
+         CHECK(level >= 0.0f && level <= 1.0f && !std::signbit(level));
+      }
+   }
+}
+
+/* A change made by someone else is undone, the writes of the enforcer
+ * itself are not taken for one */
+static void TestEnforce()
+{
+   Reset(2);
+   bool ok = false;
+   std::thread enforcer([&ok] { ok = RunEnforce(); });
+   const bool watching = WaitFor([] {
+      return fakeEndpoints_[1]->callback != nullptr;
+   });
+   CHECK(watching);
+   if (watching) {
+      FakeVolume other(*fakeEndpoints_[0]);
+      other.SetMute(FALSE, nullptr);
+      CHECK(WaitFor([] { return !!fakeEndpoints_[0]->muted; }));
+      SetEvent(stopEvent_);
+   }
+   enforcer.join();
+   CHECK(ok);
+   CHECK(AllMuted());
+   CHECK(enforceStats_.reactions == 1);
+   CHECK(fakeEndpoints_[0]->callback == nullptr);
+}
+
+/* A new endpoint is muted on its own, without another enumeration */
+static void TestAutoMute()
+{
+   Reset(3);
+   fakeEndpoints_[2]->state = DEVICE_STATE_NOTPRESENT;
+   bool ok = false;
+   std::thread watcher([&ok] { ok = RunAutoMute(); });
+   const bool listening = WaitFor([] { return fakeClient_ != nullptr; });
+   CHECK(listening);
+   if (listening) {
+      fakeEndpoints_[2]->state = DEVICE_STATE_ACTIVE;
+      fakeClient_.load()->OnDeviceAdded(L"fake-2");
+      fakeClient_.load()->OnDeviceStateChanged(L"fake-2", DEVICE_STATE_ACTIVE);
+      CHECK(WaitFor(AllMuted));
+      SetEvent(stopEvent_);
+   }
+   watcher.join();
+   CHECK(ok);
+   CHECK(fakeEnumerations_ == 1);
+   CHECK(std::count(muteOrder_.begin(), muteOrder_.end(), L"fake-2") == 1);
+   CHECK(arrivalLatency_.count >= 1);
+   CHECK(fakeClient_ == nullptr);
+}
+
+static void TestInactive()
+{
+   Reset(3);
+   fakeEndpoints_[1]->state = DEVICE_STATE_DISABLED;
+   fakeEndpoints_[2]->state = DEVICE_STATE_UNPLUGGED;
+   fakeEndpoints_[2]->muted = TRUE;
+   opts_.silent = false;
+   opts_.stateMask |= DEVICE_STATE_DISABLED | DEVICE_STATE_UNPLUGGED;
+   std::wstring report;
+   capture_ = &report;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   capture_ = nullptr;
+   CHECK(AllMuted());
+   CHECK(endpoints.size() == 3);
+   CHECK(report.find(L"Found audio endpoint \"Fake 1\" (disabled)")
+         != std::wstring::npos);
+   CHECK(report.find(
+            L"1 of 1 disabled endpoints accepted the write, 0 already were "
+            L"in the state")
+         != std::wstring::npos);
+   CHECK(report.find(
+            L"0 of 1 unplugged endpoints accepted the write, 1 already were "
+            L"in the state")
+         != std::wstring::npos);
+   CHECK(report.find(L"active endpoints") != std::wstring::npos);
+}
+
+static void TestSingleFlight()
+{
+   /* The same request however it is written, another one for another
+    * action */
+   ResetOptions();
+   opts_.ids = { L"fake-0", L"fake-1" };
+   filter_.Add(L"name:*usb*", false);
+   filter_.Add(L"id:fake-2", true);
+   const ULONGLONG key = RequestKey();
+   ResetOptions();
+   opts_.ids = { L"fake-1", L"fake-0" };
+   filter_.Add(L"id:fake-2", true);
+   filter_.Add(L"name:*usb*", false);
+   CHECK(RequestKey() == key);
+   opts_.action = Action::Unmute;
+   CHECK(RequestKey() != key);
+
+   Reset(2);
+   opts_.requestKey = RequestKey();
+   CHECK(RunSingleFlight());
+   CHECK(AllMuted());
+
+   /* An identical run that finishes while this one waits is taken over.
+    * This needs the objects across sessions, which may not be available
+    * to the user running the tests. */
+   HANDLE mutex = OpenFlightMutex();
+   HANDLE mapping = (mutex != nullptr) ? OpenFlightSlot() : nullptr;
+   FlightSlot* slot = (mapping != nullptr)
+      ? static_cast<FlightSlot*>(MapViewOfFile(
+           mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(FlightSlot)))
+      : nullptr;
+   if (slot != nullptr && WaitForSingleObject(mutex, 1000) == WAIT_OBJECT_0) {
+      Reset(2);
+      opts_.requestKey = RequestKey();
+      bool ok = false;
+      std::thread waiting([&ok] { ok = RunSingleFlight(); });
+      /* Gives it the time to start waiting */
+      Sleep(200);
+      slot->key = opts_.requestKey;
+      slot->success = TRUE;
+      slot->endpoints = 2;
+      slot->changed = 2;
+      InterlockedIncrement(&slot->sequence);
+      ReleaseMutex(mutex);
+      waiting.join();
+      CHECK(ok);
+      CHECK(NoneMuted());
+   }
+   if (slot != nullptr) {
+      UnmapViewOfFile(slot);
+   }
+   if (mapping != nullptr) {
+      CloseHandle(mapping);
+   }
+   if (mutex != nullptr) {
+      CloseHandle(mutex);
+   }
+}
+
+/* The second run finds everything as the first one left it and does not
+ * touch a single endpoint, until the set of endpoints changes */
+static void TestCache()
+{
+   Reset(3);
+   const std::string path = TempPath("cache.bin");
+   opts_.cachePath = path;
+   measure_ = true;
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   CheckChanged(endpoints);
+
+   ResetOptions();
+   opts_.silent = false;
+   opts_.cachePath = path;
+   opts_.trustCache = true;
+   measure_ = true;
+   std::wstring report;
+   capture_ = &report;
+   CHECK(Mute(endpoints));
+   capture_ = nullptr;
+   CHECK(report.find(L"Cache hit: 3 of 3 endpoints as expected")
+         != std::wstring::npos);
+   CHECK(report.find(L"> Fake 1 is already muted.") != std::wstring::npos);
+   for (const Endpoint& ep : endpoints) {
+      CHECK(ep.trusted && ep.status == EndpointStatus::Unchanged);
+   }
+   for (const std::unique_ptr<FakeEndpoint>& ep : fakeEndpoints_) {
+      CHECK(ep->muteReads == 1);
+      CHECK(ep->propertyStores == 1);
+   }
+
+   AddFake();
+   ResetOptions();
+   opts_.silent = false;
+   opts_.cachePath = path;
+   opts_.trustCache = true;
+   measure_ = true;
+   report.clear();
+   capture_ = &report;
+   CHECK(Mute(endpoints));
+   capture_ = nullptr;
+   RemoveFile(path);
+   CHECK(report.find(L"Cache miss") != std::wstring::npos);
+   CHECK(AllMuted());
+}
+
+/* Names come from the cache on the second run, a renamed endpoint is read
+ * again */
+static void TestNameCache()
+{
+   Reset(3);
+   const std::string path = TempPath("names.bin");
+   opts_.silent = false;
+   opts_.nameCachePath = path;
+   std::wstring report;
+   capture_ = &report;
+   nameCache_.Open(path);
+   std::vector<Endpoint> endpoints;
+   CHECK(Mute(endpoints));
+   nameCache_.Close();
+
+   fakeEndpoints_[1]->name = L"Renamed";
+   DeviceTable table;
+   table.OnPropertyValueChanged(L"fake-1", PKEY_Device_FriendlyName);
+   nameCache_.Open(path);
+   report.clear();
+   CHECK(Mute(endpoints));
+   nameCache_.Close();
+   capture_ = nullptr;
+   /* Detached from the file again, for the tests after this one */
+   nameCache_.Open(std::string());
+   RemoveFile(path);
+
+   CHECK(fakeEndpoints_[0]->propertyStores == 1);
+   CHECK(fakeEndpoints_[1]->propertyStores == 2);
+   CHECK(fakeEndpoints_[2]->propertyStores == 1);
+   CHECK(report.find(L"> Fake 0 is already muted.") != std::wstring::npos);
+   CHECK(report.find(L"> Renamed is already muted.") != std::wstring::npos);
+}
+
+/* A -timeout run ends the process, so each case runs in a child, which is
+ * this program started again with -scenario. The child runs the tool's own
+ * main with the arguments of the case, the fakes print every endpoint they
+ * mute. */
+struct TimeoutCase {
+   const char* name;
+   const char* args;
+   int hung;          /* endpoint that never returns from GetMute, or -1 */
+   bool queued;       /* the endpoints after the hung one never start */
+   int exitCode;
+   const char* expect;   /* in the output, or null */
+};
+
+static const TimeoutCase timeoutCases_[] = {
+   { "hung", "-jobs 3 -timeout 300", 1, false, exitTimedOut_, nullptr },
+   {
+      "hung-fade", "-jobs 3 -timeout 300 -fade 2000", 1, false,
+      exitTimedOut_, nullptr
+   },
+   { "hung-queued", "-timeout 300", 0, true, exitTimedOut_, nullptr },
+   {
+      "fade-cut", "-jobs 3 -timeout 300 -fade 2000 -timings", -1, false,
+      EXIT_SUCCESS, "First silence"
+   },
+};
+
+static int RunScenario(const char* self, const char* name)
+{
+   const TimeoutCase* found = nullptr;
+   for (const TimeoutCase& tc : timeoutCases_) {
+      if (strcmp(tc.name, name) == 0) {
+         found = &tc;
+      }
+   }
+   if (found == nullptr) {
+      return EXIT_FAILURE;
+   }
+   Reset(3);
+   reportMutes_ = true;
+   opts_.silent = false;
+   if (found->hung >= 0) {
+      fakeEndpoints_[found->hung]->hang = true;
+   }
+   std::string args = found->args;
+   std::vector<char*> argv = { const_cast<char*>(self) };
+   for (char* context = nullptr,
+           * arg = strtok_s(args.data(), " ", &context);
+        arg != nullptr; arg = strtok_s(nullptr, " ", &context)) {
+      argv.push_back(arg);
+   }
+   return MuteMain(static_cast<int>(argv.size()), argv.data());
+}
+
+static int RunChild(const char* scenario, std::string& output)
+{
+   char path[MAX_PATH];
+   if (GetModuleFileNameA(nullptr, path, MAX_PATH) == 0) {
+      return -1;
+   }
+   /* cmd.exe strips the outer quotes */
+   const std::string command =
+      std::string("\"\"") + path + "\" -scenario " + scenario + "\"";
+   FILE* pipe = _popen(command.c_str(), "r");
+   if (pipe == nullptr) {
+      return -1;
+   }
+   char line[256];
+   while (fgets(line, sizeof line, pipe) != nullptr) {
+      output += line;
+   }
+   return _pclose(pipe);
+}
+
+static void TestTimeout()
+{
+   for (const TimeoutCase& tc : timeoutCases_) {
+      std::string output;
+      const auto start = std::chrono::steady_clock::now();
+      const int rc = RunChild(tc.name, output);
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      if (rc != tc.exitCode) {
+         std::fprintf(stderr, "scenario %s exited with %d\n", tc.name, rc);
+      }
+      CHECK(rc == tc.exitCode);
+      CHECK(elapsed < std::chrono::seconds(5));
+
+      /* Endpoints queued behind a hung one never get to run */
+      for (int i = 0; i < 3; ++i) {
+         const bool reached = (tc.hung < 0)
+            || (i != tc.hung && (!tc.queued || i < tc.hung));
+         const std::string muted = "muted fake-" + std::to_string(i) + "\n";
+         CHECK((output.find(muted) != std::string::npos) == reached);
+      }
+      if (tc.expect != nullptr) {
+         CHECK(output.find(tc.expect) != std::string::npos);
+      }
+   }
+}
+
+int main(int argc, char** argv)
+{
+   createEnumerator_ = CreateFakeEnumerator;
+   /* The tool initializes COM itself */
+   if (argc == 3 && strcmp(argv[1], "-scenario") == 0) {
+      return RunScenario(argv[0], argv[2]);
+   }
+   if (CoInitializeEx(nullptr, COINIT_MULTITHREADED) != S_OK) {
+      std::fprintf(stderr, "Failed to initialize COM library\n");
+      return EXIT_FAILURE;
+   }
+   SelectLevelKernels();
+
+   static const struct {
+      const char* name;
+      void (*run)();
+   } tests[] = {
+      { "serial", TestSerial },
+      { "jobs", TestJobs },
+      { "jobs-report-in-order", TestJobsReportInOrder },
+      { "pipeline", TestPipeline },
+      { "daemon", TestDaemon },
+      { "device-table", TestDeviceTable },
+      { "lazy-activation", TestLazyActivation },
+      { "timings", TestTimings },
+      { "trace", TestTrace },
+      { "output-writer", TestOutputWriter },
+      { "json", TestJson },
+      { "capture", TestCapture },
+      { "default-first", TestDefaultFirst },
+      { "ids", TestIds },
+      { "filter", TestFilter },
+      { "apps", TestApps },
+      { "save-restore", TestSaveRestore },
+      { "toggle", TestToggle },
+      { "fade-out", TestFadeOut },
+      { "fade-in", TestFadeIn },
+      { "fade-failure", TestFadeFailure },
+      { "level-kernels", TestLevelKernels },
+      { "enforce", TestEnforce },
+      { "auto-mute", TestAutoMute },
+      { "inactive", TestInactive },
+      { "single-flight", TestSingleFlight },
+      { "cache", TestCache },
+      { "name-cache", TestNameCache },
+      { "timeout", TestTimeout },
+   };
+   for (const auto& test : tests) {
+      const int before = failures_;
+      test.run();
+      std::printf(
+         "%-24s %s\n", test.name, (failures_ == before) ? "ok" : "FAILED");
+   }
+   CoUninitialize();
+   std::printf("%d check(s) failed\n", failures_);
+   return (failures_ == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}